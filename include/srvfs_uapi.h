@@ -0,0 +1,56 @@
+#ifndef __SRVFS_UAPI_H
+#define __SRVFS_UAPI_H
+
+/*
+ * Interface between the srvfs kernel driver and userland, shared by the
+ * kernel module and libsrvfs.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Binary post record: alternatively to the decimal printed fd number,
+ * a program can write this record into an srvfs entry. The whole record
+ * has to be written by a single write() call at offset 0.
+ *
+ * Posting fd -1 detaches the currently posted file from the entry.
+ *
+ * Posting more than one fd creates a sharded entry: each write on it goes
+ * to one of the fds, picked by the writer's current CPU (default) or NUMA
+ * node, so writers on different CPUs don't contend on a single backend.
+ * Each write goes to exactly one backend in one piece, so message
+ * boundaries are kept. All other operations (read, poll, ...) go to the
+ * first fd. All fds need to be of the same kind (eg. all pipes).
+ */
+#define SRVFS_POST_MAGIC	0x50565253	/* "SRVP" */
+#define SRVFS_POST_VERSION	1
+
+#define SRVFS_POST_SHARD_CPU	0x1	/* route writes by CPU */
+#define SRVFS_POST_SHARD_NODE	0x2	/* route writes by NUMA node */
+#define SRVFS_POST_FLAGS	(SRVFS_POST_SHARD_CPU | SRVFS_POST_SHARD_NODE)
+
+#define SRVFS_POST_MAX_FDS	256
+
+struct srvfs_post {
+	__u32	magic;
+	__u16	version;
+	__u16	flags;		/* SRVFS_POST_* */
+	__u32	nfds;		/* number of entries in fds[] */
+	__u32	reserved;	/* must be 0 */
+	__s32	fds[];
+};
+
+#define SRVFS_POST_SIZE(nfds) \
+	(sizeof(struct srvfs_post) + (nfds) * sizeof(__s32))
+
+/*
+ * Reposting: once a file is posted, opening the entry gives a proxy to it,
+ * so write() goes to the posted file. To post another file into the entry,
+ * pass a post record to this ioctl() on any fd opened for writing on the
+ * entry, proxy or not.
+ */
+#define SRVFS_IOC_MAGIC		0xb7
+#define SRVFS_IOC_POST		_IOW(SRVFS_IOC_MAGIC, 1, struct srvfs_post)
+
+#endif /* __SRVFS_UAPI_H */
@@ -8,18 +8,54 @@
 #include <linux/fs.h>
 #include <linux/file.h>
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/compat.h>
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
+/*
+ * In handoff mode, the first opener takes over the posted file: it gets
+ * moved into a private fileref of the new proxy, leaving the entry
+ * unassigned again, so it can be reposted.
+ */
+static struct srvfs_fileref *srvfs_file_handoff(struct inode *inode,
+						struct srvfs_fileref *fileref)
+{
+	struct srvfs_sb *sbpriv = inode->i_sb->s_fs_info;
+	struct srvfs_fileref *own;
+
+	if (!sbpriv->opts.handoff)
+		return fileref;
+
+	own = srvfs_fileref_takeover(fileref);
+	if (!own)
+		return fileref;
+
+	pr_info("open inode: handing off the posted file\n");
+	srvfs_fileref_put(fileref);
+	return own;
+}
+
 static int srvfs_file_open(struct inode *inode, struct file *file)
 {
 	struct srvfs_fileref *fileref = inode->i_private;
+	int ret;
+
 	pr_info("open inode_id=%ld\n", inode->i_ino);
-	file->private_data = srvfs_fileref_get(fileref);
+	srvfs_fileref_get(fileref);
+
+	if (fileref->file)
+		fileref = srvfs_file_handoff(inode, fileref);
+
+	file->private_data = fileref;
 
 	if (fileref->file) {
 		pr_info("open inode: already assigned another file\n");
-		srvfs_proxy_fill_fops(file);
+		ret = srvfs_proxy_open(file, fileref);
+		if (ret) {
+			srvfs_fileref_put(fileref);
+			return ret;
+		}
 //		file->f_op = &proxy_file_ops;
 	}
 	else {
@@ -87,9 +123,66 @@ static ssize_t srvfs_file_read(struct file *file, char *buf,
 	else \
 		pr_info("assigned file has " STR(name) " operation: %pF", newfile->f_op->name); \
 
+static bool srvfs_is_srvfs_file(struct file *file)
+{
+	return file_inode(file)->i_fop == &srvfs_file_ops;
+}
+
+/*
+ * Resolve a file that's about to be posted into @fileref down to the
+ * backend file it's actually referring to. Posting an srvfs file (from
+ * the same or any other srvfs mount) would otherwise create a chain of
+ * proxies, where each op needs to go through several trampolines.
+ *
+ * As every post gets flattened this way, the backend of an srvfs file
+ * never is an srvfs file itself, so one hop is usually enough. The hop
+ * limit just protects against ending up in a loop.
+ *
+ * Consumes the reference on @newfile. Returns a referenced backend file
+ * or ERR_PTR() on failure.
+ */
+struct file *srvfs_resolve_file(struct srvfs_fileref *fileref,
+				struct file *newfile)
+{
+	int hops;
+
+	for (hops = 0; hops < SRVFS_MAX_HOPS; hops++) {
+		struct srvfs_fileref *other;
+		struct file *backend;
+
+		if (!srvfs_is_srvfs_file(newfile))
+			return newfile;
+
+		/* our reference on newfile keeps the other fileref alive */
+		other = srvfs_file_fileref(newfile);
+		if (other == fileref) {
+			pr_err("whoops. trying to link inode with itself!\n");
+			fput(newfile);
+			return ERR_PTR(-ELOOP);
+		}
+
+		/* the other entry might get reposted concurrently */
+		backend = srvfs_fileref_get_file(other);
+		fput(newfile);
+
+		if (!backend) {
+			pr_info("srvfs file has no backend assigned yet\n");
+			return ERR_PTR(-EINVAL);
+		}
+
+		pr_info("resolved srvfs file to its backend\n");
+		newfile = backend;
+	}
+
+	pr_err("whoops. too many hops while resolving srvfs file!\n");
+	fput(newfile);
+	return ERR_PTR(-ELOOP);
+}
+
 static int do_switch(struct file *file, long fd)
 {
-	struct srvfs_fileref *fileref= file->private_data;
+	/* the entry's own fileref, also when called via a proxy */
+	struct srvfs_fileref *fileref = file_inode(file)->i_private;
 	struct file *newfile = fget(fd);
 	pr_info("doing the switch: fd=%ld\n", fd);
 
@@ -98,15 +191,9 @@ static int do_switch(struct file *file, long fd)
 		goto setref;
 	}
 
-	if (newfile->f_inode == file->f_inode) {
-		pr_err("whoops. trying to link inode with itself!\n");
-		goto loop;
-	}
-
-	if (newfile->f_inode->i_sb == file->f_inode->i_sb) {
-		pr_err("whoops. trying to link inode within same fs!\n");
-		goto loop;
-	}
+	newfile = srvfs_resolve_file(fileref, newfile);
+	if (IS_ERR(newfile))
+		return PTR_ERR(newfile);
 
 	pr_info("assigning inode %ld\n", newfile->f_inode->i_ino);
 	if (newfile && newfile->f_path.dentry)
@@ -122,10 +209,98 @@ static int do_switch(struct file *file, long fd)
 setref:
 	srvfs_fileref_set(fileref, newfile);
 	return 0;
+}
 
-loop:
-	fput(newfile);
-	return -ELOOP;
+static int do_switch_shards(struct file *file, const __s32 *fds,
+			    unsigned int nfds, unsigned int flags)
+{
+	struct srvfs_fileref *fileref = file_inode(file)->i_private;
+	struct srvfs_shards *shards;
+	struct file *newfile;
+	unsigned int i;
+	int ret;
+
+	pr_info("doing the switch to %u shards\n", nfds);
+
+	shards = srvfs_shards_new(fileref->sbpriv, nfds, flags);
+	if (IS_ERR(shards))
+		return PTR_ERR(shards);
+
+	for (i = 0; i < nfds; i++) {
+		newfile = fget(fds[i]);
+		if (!newfile) {
+			pr_info("invalid fd passed\n");
+			ret = -EBADF;
+			goto err;
+		}
+
+		newfile = srvfs_resolve_file(fileref, newfile);
+		if (IS_ERR(newfile)) {
+			ret = PTR_ERR(newfile);
+			goto err;
+		}
+
+		shards->files[shards->nfiles++] = newfile;
+
+		/* the proxy's fops are built from the first one */
+		if (newfile->f_op != shards->files[0]->f_op) {
+			pr_info("shards need to be of the same kind\n");
+			ret = -EINVAL;
+			goto err;
+		}
+	}
+
+	srvfs_fileref_set_shards(fileref, shards);
+	return 0;
+
+err:
+	srvfs_shards_put(shards);
+	return ret;
+}
+
+static ssize_t srvfs_post_binary(struct file *file, const char *buf,
+				 size_t count)
+{
+	struct srvfs_post post;
+	__s32 fd, *fds;
+	int ret;
+
+	if (copy_from_user(&post, buf, sizeof(post)))
+		return -EFAULT;
+
+	if ((post.version != SRVFS_POST_VERSION) ||
+	    (post.flags & ~SRVFS_POST_FLAGS) ||
+	    ((post.flags & SRVFS_POST_FLAGS) == SRVFS_POST_FLAGS) ||
+	    post.reserved) {
+		pr_info("binary post: unsupported version or flags\n");
+		return -EINVAL;
+	}
+
+	if (!post.nfds || (post.nfds > SRVFS_POST_MAX_FDS) ||
+	    (count != SRVFS_POST_SIZE(post.nfds))) {
+		pr_info("binary post: invalid number of fds\n");
+		return -EINVAL;
+	}
+
+	if ((post.nfds == 1) && !post.flags) {
+		if (copy_from_user(&fd, buf + sizeof(post), sizeof(fd)))
+			return -EFAULT;
+
+		ret = do_switch(file, fd);
+	} else {
+		fds = memdup_user(buf + sizeof(post),
+				  post.nfds * sizeof(__s32));
+		if (IS_ERR(fds))
+			return PTR_ERR(fds);
+
+		ret = do_switch_shards(file, fds, post.nfds, post.flags);
+		kfree(fds);
+	}
+
+	if (ret)
+		return ret;
+
+	return count;
 }
 
 static ssize_t srvfs_file_write(struct file *file, const char *buf,
@@ -135,7 +310,21 @@ static ssize_t srvfs_file_write(struct file *file, const char *buf,
 	long fd;
 	int ret;
 
-	if ((*offset != 0) || (count >= TMPSIZE))
+	if (*offset != 0)
+		return -EINVAL;
+
+	if (count >= sizeof(struct srvfs_post)) {
+		u32 magic;
+
+		if (get_user(magic, (const u32 *)buf))
+			return -EFAULT;
+
+		if (magic == SRVFS_POST_MAGIC)
+			return srvfs_post_binary(file, buf, count);
+	}
+
+	/* legacy post: fd number printed as decimal string */
+	if (count >= TMPSIZE)
 		return -EINVAL;
 
 	memset(tmp, 0, TMPSIZE);
@@ -151,21 +340,76 @@ static ssize_t srvfs_file_write(struct file *file, const char *buf,
 	return count;
 }
 
+/*
+ * SRVFS_IOC_POST: post a record via ioctl() on the control file or on a
+ * proxy, which is the only way to repost an entry that already has a file
+ * posted: write() on a proxy goes to the posted file.
+ */
+long srvfs_file_post_ioctl(struct file *file, void __user *arg)
+{
+	struct srvfs_post post;
+	ssize_t ret;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if (copy_from_user(&post, arg, sizeof(post)))
+		return -EFAULT;
+
+	if (post.magic != SRVFS_POST_MAGIC)
+		return -EINVAL;
+
+	ret = srvfs_post_binary(file, arg, SRVFS_POST_SIZE(post.nfds));
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+static long srvfs_file_ioctl(struct file *file, unsigned int cmd,
+			     unsigned long arg)
+{
+	if (cmd == SRVFS_IOC_POST)
+		return srvfs_file_post_ioctl(file, (void __user *)arg);
+
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+static long srvfs_file_compat_ioctl(struct file *file, unsigned int cmd,
+				    unsigned long arg)
+{
+	return srvfs_file_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
 struct file_operations srvfs_file_ops = {
 	.owner		= THIS_MODULE,
 	.open		= srvfs_file_open,
 	.read		= srvfs_file_read,
 	.write		= srvfs_file_write,
+	.unlocked_ioctl	= srvfs_file_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= srvfs_file_compat_ioctl,
+#endif
 	.release	= srvfs_file_release,
 };
 
 int srvfs_insert_file (struct super_block *sb, struct dentry *dentry)
 {
+	struct srvfs_sb *sbpriv = sb->s_fs_info;
 	struct inode *inode;
 	struct srvfs_fileref *fileref;
-	int mode = S_IFREG | S_IWUSR | S_IRUGO;
+	int mode = S_IFREG | sbpriv->opts.file_mode;
+	int ret;
+
+	ret = srvfs_sb_claim_entry(sb);
+	if (ret) {
+		pr_info_ratelimited("entry refused, over max_entries or max_mem\n");
+		goto err_claim;
+	}
 
-	fileref = srvfs_fileref_new();
+	fileref = srvfs_fileref_new(sbpriv);
 	if (!fileref)
 		goto nomem;
 
@@ -192,5 +436,9 @@ err_inode:
 	srvfs_fileref_put(fileref);
 nomem:
 	pr_err("failed to allocate memory\n");
-	return -ENOMEM;
+	srvfs_sb_release_entry(sb);
+	ret = -ENOMEM;
+err_claim:
+	dput(dentry);
+	return ret;
 }
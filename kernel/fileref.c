@@ -2,18 +2,43 @@
 
 #include <linux/slab.h>
 #include <linux/file.h>
+#include <linux/rcupdate.h>
+#include <linux/smp.h>
+#include <linux/topology.h>
 
 #include "srvfs.h"
 
-struct srvfs_fileref *srvfs_fileref_new(void)
+static struct kmem_cache *srvfs_fileref_cache;
+
+int srvfs_fileref_cache_init(void)
+{
+	srvfs_fileref_cache = kmem_cache_create("srvfs_fileref",
+		sizeof(struct srvfs_fileref), 0, SLAB_ACCOUNT, NULL);
+	if (!srvfs_fileref_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void srvfs_fileref_cache_exit(void)
+{
+	kmem_cache_destroy(srvfs_fileref_cache);
+}
+
+/* sbpriv may be NULL for filerefs not belonging to an entry */
+struct srvfs_fileref *srvfs_fileref_new(struct srvfs_sb *sbpriv)
 {
 	struct srvfs_fileref *fileref;
 
-	fileref = kzalloc(sizeof(struct srvfs_fileref), GFP_KERNEL);
+	fileref = kmem_cache_alloc(srvfs_fileref_cache, GFP_KERNEL_ACCOUNT);
 	if (!fileref)
 		return NULL;
 
+	memset(fileref, 0, sizeof(struct srvfs_fileref));
+	fileref->sbpriv = sbpriv;
+	INIT_LIST_HEAD(&fileref->fops_node);
 	kref_init(&fileref->refcount);
+	srvfs_poll_init(&fileref->poll);
 	return fileref;
 }
 
@@ -23,12 +48,60 @@ struct srvfs_fileref *srvfs_fileref_get(struct srvfs_fileref *fileref)
 	return fileref;
 }
 
+/* sbpriv may be NULL, if there's no mount budget to charge */
+struct srvfs_shards *srvfs_shards_new(struct srvfs_sb *sbpriv,
+				      unsigned int nfiles, unsigned int flags)
+{
+	struct srvfs_shards *shards;
+	size_t size = sizeof(struct srvfs_shards) +
+		      nfiles * sizeof(struct file *);
+	int ret;
+
+	ret = srvfs_sb_charge(sbpriv, size);
+	if (ret)
+		return ERR_PTR(ret);
+
+	shards = kzalloc(size, GFP_KERNEL_ACCOUNT);
+	if (!shards) {
+		srvfs_sb_uncharge(sbpriv, size);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	shards->flags = flags;
+	shards->sbpriv = sbpriv;
+	shards->charged = size;
+	return shards;
+}
+
+/*
+ * Writers might still be picking a file from the shards under RCU, and
+ * get_file_rcu() fails on the ones we've just dropped.
+ */
+void srvfs_shards_put(struct srvfs_shards *shards)
+{
+	unsigned int i;
+
+	if (!shards)
+		return;
+
+	for (i = 0; i < shards->nfiles; i++)
+		fput(shards->files[i]);
+
+	srvfs_sb_uncharge(shards->sbpriv, shards->charged);
+	kfree_rcu(shards, rcu);
+}
+
 void srvfs_fileref_destroy(struct kref *ref)
 {
 	struct srvfs_fileref *fileref = container_of(ref, struct srvfs_fileref, refcount);
-	if (fileref->file)
+	srvfs_fileref_drop_fops(fileref);
+	srvfs_shards_put(fileref->shards);
+	if (fileref->file) {
+		srvfs_poll_repost(fileref, fileref->file);
 		fput(fileref->file);
-	kfree(fileref);
+	}
+
+	kmem_cache_free(srvfs_fileref_cache, fileref);
 }
 
 void srvfs_fileref_put(struct srvfs_fileref *fileref)
@@ -38,13 +111,178 @@ void srvfs_fileref_put(struct srvfs_fileref *fileref)
 	kref_put(&fileref->refcount, srvfs_fileref_destroy);
 }
 
-void srvfs_fileref_set(struct srvfs_fileref *fileref, struct file *newfile)
+static void srvfs_fileref_set_file(struct srvfs_fileref *fileref,
+				   struct file *newfile)
 {
 	struct file *oldfile;
 
-	oldfile = fileref->file;
-	fileref->file = newfile;
+	/*
+	 * other entries might be resolving to our file under RCU, so
+	 * swap atomically - the old one is freed via RCU by fput()
+	 */
+	oldfile = xchg(&fileref->file, newfile);
+
+	/* move pollers over to the new file */
+	srvfs_poll_repost(fileref, oldfile);
 
 	if (oldfile)
 		fput(oldfile);
 }
+
+void srvfs_fileref_set(struct srvfs_fileref *fileref, struct file *newfile)
+{
+	srvfs_shards_put(xchg(&fileref->shards, NULL));
+	srvfs_fileref_set_file(fileref, newfile);
+}
+
+/*
+ * Post a set of backends, writes get spread over. All other operations
+ * go to the first one.
+ */
+void srvfs_fileref_set_shards(struct srvfs_fileref *fileref,
+			      struct srvfs_shards *shards)
+{
+	struct srvfs_shards *oldshards;
+
+	oldshards = xchg(&fileref->shards, shards);
+	srvfs_fileref_set_file(fileref, get_file(shards->files[0]));
+	srvfs_shards_put(oldshards);
+}
+
+/*
+ * Drop the cached proxy fops, eg. under memory pressure. Proxies still
+ * using it keep it alive, the next open builds a new one.
+ */
+bool srvfs_fileref_drop_fops(struct srvfs_fileref *fileref)
+{
+	struct srvfs_sb *sbpriv = fileref->sbpriv;
+	struct srvfs_fops *fops;
+
+	if (!READ_ONCE(fileref->fops))
+		return false;
+
+	if (sbpriv)
+		spin_lock(&sbpriv->fops_lock);
+	fops = xchg(&fileref->fops, NULL);
+	if (sbpriv && !list_empty(&fileref->fops_node)) {
+		list_del_init(&fileref->fops_node);
+		atomic_long_dec(&sbpriv->nr_idle_fops);
+	}
+	if (sbpriv)
+		spin_unlock(&sbpriv->fops_lock);
+
+	if (!fops)
+		return false;
+
+	srvfs_fops_put(fops);
+	return true;
+}
+
+/*
+ * Scan up to nr filerefs on the mount's idle list, oldest first, and drop
+ * their cached fops. Filerefs go onto the list when the last proxy using
+ * their cached table is gone, and leave it before they're freed, so the
+ * ones on it are still alive. Tables that got busy again are just taken
+ * off the list, like the dcache does with referenced dentries. Returns
+ * the number of tables actually freed.
+ */
+long srvfs_sb_drop_fops(struct srvfs_sb *sbpriv, long nr)
+{
+	struct srvfs_fileref *fileref;
+	struct srvfs_fops *fops;
+	long freed = 0;
+
+	spin_lock(&sbpriv->fops_lock);
+	for (; (nr > 0) && !list_empty(&sbpriv->fops_list); nr--) {
+		fileref = list_first_entry(&sbpriv->fops_list,
+					   struct srvfs_fileref, fops_node);
+		list_del_init(&fileref->fops_node);
+		atomic_long_dec(&sbpriv->nr_idle_fops);
+
+		if (kref_read(&fileref->fops->refcount) > 1)
+			continue;
+
+		/* an open might just be taking it, then it's not freed */
+		fops = xchg(&fileref->fops, NULL);
+		if (srvfs_fops_put(fops))
+			freed++;
+	}
+	spin_unlock(&sbpriv->fops_lock);
+
+	return freed;
+}
+
+/*
+ * Move the posted file(s) over into a new fileref, leaving this one
+ * unassigned. Returns NULL if there's nothing (anymore) to take over.
+ */
+struct srvfs_fileref *srvfs_fileref_takeover(struct srvfs_fileref *fileref)
+{
+	struct srvfs_fileref *newref;
+	struct file *file;
+
+	/* not an entry, so nothing to charge against the mount */
+	newref = srvfs_fileref_new(NULL);
+	if (!newref)
+		return NULL;
+
+	file = xchg(&fileref->file, NULL);
+	if (!file) {
+		/* somebody else was faster */
+		srvfs_fileref_put(newref);
+		return NULL;
+	}
+
+	srvfs_poll_repost(fileref, file);
+	newref->shards = xchg(&fileref->shards, NULL);
+	newref->file = file;
+	return newref;
+}
+
+/*
+ * Get a reference on the currently posted file, so a concurrent repost
+ * can't release it while we're using it. Returns NULL if there's none.
+ */
+struct file *srvfs_fileref_get_file(struct srvfs_fileref *fileref)
+{
+	struct file *file;
+
+	rcu_read_lock();
+	do {
+		file = READ_ONCE(fileref->file);
+		/* if it's just being released, it's been reposted already */
+	} while (file && !get_file_rcu(file));
+	rcu_read_unlock();
+
+	return file;
+}
+
+/*
+ * Pick the shard for the current CPU or NUMA node. Returns a referenced
+ * file or NULL, if the entry isn't sharded (anymore).
+ */
+struct file *srvfs_fileref_get_shard(struct srvfs_fileref *fileref)
+{
+	struct srvfs_shards *shards;
+	struct file *file = NULL;
+	unsigned int idx;
+
+	if (!READ_ONCE(fileref->shards))
+		return NULL;
+
+	rcu_read_lock();
+	shards = READ_ONCE(fileref->shards);
+	if (shards) {
+		if (shards->flags & SRVFS_POST_SHARD_NODE)
+			idx = numa_node_id();
+		else
+			idx = raw_smp_processor_id();
+
+		file = shards->files[idx % shards->nfiles];
+		if (!get_file_rcu(file))
+			file = NULL;
+	}
+	rcu_read_unlock();
+
+	return file;
+}
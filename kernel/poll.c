@@ -0,0 +1,203 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include "srvfs.h"
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <net/busy_poll.h>
+
+/*
+ * Poll passthrough
+ *
+ * Instead of letting each poller register on the backend's wait queues
+ * via the proxy, every fileref registers itself once on the backend's
+ * queues and forwards the wakeups to its own wait queue, where the proxies'
+ * pollers (poll, select, epoll) are waiting.
+ *
+ * That way, pollers stay registered when the entry gets reposted: we just
+ * move our own registration over to the new backend and wake everybody up,
+ * so they re-poll the new one. Since the pollers wait on a regular wait
+ * queue of ours, EPOLLEXCLUSIVE works as usual.
+ *
+ * We register on as many queues as the backend has. If that fails, we
+ * don't register at all, but report POLLERR and try again on the next
+ * poll, as epoll fails the insertion then.
+ */
+
+static int srvfs_poll_wake(wait_queue_t *wait, unsigned mode, int sync,
+			   void *key)
+{
+	struct srvfs_poll_entry *entry = container_of(wait,
+		struct srvfs_poll_entry, wait);
+	struct srvfs_poll *p = entry->poll;
+	unsigned long events = (unsigned long)key;
+
+	if (events & POLLFREE) {
+		/*
+		 * the backend's wait queue is going away (eg. signalfd),
+		 * see ep_poll_callback() for the details
+		 */
+		list_del_init(&wait->task_list);
+		smp_store_release(&entry->whead, NULL);
+		events &= ~POLLFREE;
+	}
+
+	if (sync)
+		__wake_up_sync_key(&p->wq, mode, 1, (void *)events);
+	else
+		__wake_up(&p->wq, mode, 1, (void *)events);
+
+	return 0;
+}
+
+/* may sleep, as epoll's queue proc does */
+static void srvfs_poll_queue_proc(struct file *file, wait_queue_head_t *whead,
+				  poll_table *pt)
+{
+	struct srvfs_poll *p = container_of(pt, struct srvfs_poll, pt);
+	struct srvfs_poll_entry *entry;
+
+	entry = kmalloc(sizeof(struct srvfs_poll_entry), GFP_KERNEL);
+	if (!entry) {
+		p->failed = true;
+		return;
+	}
+
+	entry->poll = p;
+	entry->whead = whead;
+	init_waitqueue_func_entry(&entry->wait, srvfs_poll_wake);
+	list_add_tail(&entry->node, &p->entries);
+	add_wait_queue(whead, &entry->wait);
+}
+
+static void srvfs_poll_unregister(struct srvfs_poll *p)
+{
+	struct srvfs_poll_entry *entry, *tmp;
+	wait_queue_head_t *whead;
+
+	list_for_each_entry_safe(entry, tmp, &p->entries, node) {
+		rcu_read_lock();
+		whead = smp_load_acquire(&entry->whead);
+		if (whead)
+			remove_wait_queue(whead, &entry->wait);
+		rcu_read_unlock();
+		kfree(entry);
+	}
+
+	INIT_LIST_HEAD(&p->entries);
+	p->failed = false;
+	WRITE_ONCE(p->file, NULL);
+}
+
+/*
+ * p->file is published before calling into the backend, so polling an
+ * epoll backend that has a proxy of this very entry in its set doesn't
+ * try to register again, deadlocking on p->mutex. Pollers that came
+ * in before we got registered are woken up if the backend's already
+ * ready, so they can't miss an event in between.
+ */
+static int srvfs_poll_register(struct srvfs_poll *p, struct file *target)
+{
+	unsigned int mask;
+
+	WRITE_ONCE(p->file, target);
+	init_poll_funcptr(&p->pt, srvfs_poll_queue_proc);
+	p->pt._key = ~(unsigned long)POLL_BUSY_LOOP;
+	mask = target->f_op->poll(target, &p->pt);
+
+	if (p->failed) {
+		srvfs_poll_unregister(p);
+		return -ENOMEM;
+	}
+
+	if (mask)
+		wake_up_poll(&p->wq, mask);
+	return 0;
+}
+
+void srvfs_poll_init(struct srvfs_poll *p)
+{
+	mutex_init(&p->mutex);
+	init_waitqueue_head(&p->wq);
+	INIT_LIST_HEAD(&p->entries);
+}
+
+/*
+ * Drop our registration on the old backend and kick all pollers, so
+ * they re-poll the new one (edge triggered ones get a new edge).
+ * Must be called before the old backend is released.
+ */
+void srvfs_poll_repost(struct srvfs_fileref *fileref, struct file *oldfile)
+{
+	struct srvfs_poll *p = &fileref->poll;
+
+	mutex_lock(&p->mutex);
+	if (oldfile && (p->file == oldfile))
+		srvfs_poll_unregister(p);
+	mutex_unlock(&p->mutex);
+
+	wake_up_all(&p->wq);
+}
+
+/*
+ * The caller holds a reference on @target, so it can't be released by a
+ * concurrent repost while we're registering on it or querying it.
+ *
+ * We get onto our own wait queue before looking at the entry's backend:
+ * a repost from then on wakes us up, and one that came before is seen
+ * here, so we follow it to the new backend right away.
+ */
+unsigned int srvfs_poll(struct srvfs_fileref *fileref, struct file *proxy,
+			struct file *target, poll_table *pt)
+{
+	struct srvfs_poll *p = &fileref->poll;
+	struct file *current_file = NULL;
+	poll_table backend_pt;
+	unsigned int mask;
+
+	poll_wait(proxy, &p->wq, pt);
+	smp_mb();
+
+	if (READ_ONCE(fileref->file) != target) {
+		/* the proxy's table only fits the same kind of backend */
+		current_file = srvfs_fileref_get_file(fileref);
+		if (!current_file || (current_file->f_op != target->f_op)) {
+			mask = POLLERR;
+			goto out;
+		}
+		target = current_file;
+	}
+
+	if (READ_ONCE(p->file) != target) {
+		int ret = 0;
+
+		mutex_lock(&p->mutex);
+		/* don't register on a backend that's just being reposted */
+		if ((p->file != target) && (READ_ONCE(fileref->file) == target)) {
+			srvfs_poll_unregister(p);
+			ret = srvfs_poll_register(p, target);
+		}
+		mutex_unlock(&p->mutex);
+
+		if (ret) {
+			mask = POLLERR;
+			goto out;
+		}
+	}
+
+	/*
+	 * just query the backend, but pass on the requested events, so
+	 * socket backends can do busy polling
+	 */
+	init_poll_funcptr(&backend_pt, NULL);
+	backend_pt._key = poll_requested_events(pt);
+	mask = target->f_op->poll(target, &backend_pt);
+
+out:
+	if (current_file)
+		fput(current_file);
+	return mask;
+}
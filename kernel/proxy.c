@@ -6,40 +6,85 @@
 #include <linux/fs.h>
 #include <linux/file.h>
 #include <linux/slab.h>
+#include <linux/compat.h>
+#include <linux/sched.h>
+#include <linux/signal.h>
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
+/*
+ * Each op holds a reference on the backend while it's running, as a
+ * concurrent repost would release it otherwise. target is NULL if the
+ * entry has no backend (any more), ops fail with ENXIO then.
+ *
+ * A proxy keeps the fops table built for the kind of backend it was
+ * opened on, so when the entry has been reposted with another kind of
+ * file since, the table's ops don't fit it: the proxy has no backend
+ * then. Reposts of the same kind (eg. socket for socket) are followed.
+ */
 #define PROXY_INTRO \
-	struct srvfs_fileref *fileref = proxy->private_data; \
-	struct file *target = fileref->file; \
-	(void)(target); \
+	struct srvfs_proxy *sp = proxy->private_data; \
+	struct file *target = proxy_check_backend(proxy, \
+				srvfs_fileref_get_file(sp->fileref));
 
+#define PROXY_OUTRO \
+	if (target) \
+		fput(target);
+
+/* can't happen as long as the backend fits the table */
 #define PROXY_NO_BACKEND \
-	pr_info("%s() no backend file handler\n", __FUNCTION__); \
-	BUG_ON(1)
+	pr_warn_once("%s() no backend file handler\n", __FUNCTION__)
 
-#define PROXY_PASS_FILE(opname, args...) \
-	PROXY_INTRO \
-	if (target->f_op->opname) { \
-		return target->f_op->opname(args); \
-	} \
-	PROXY_RET(-EOPNOTSUPP); \
+static struct srvfs_fops *srvfs_proxy_fops(struct file *proxy);
+
+/* consumes the reference on @target */
+static struct file *proxy_check_backend(struct file *proxy,
+					struct file *target)
+{
+	if (target && (target->f_op != srvfs_proxy_fops(proxy)->backend)) {
+		fput(target);
+		return NULL;
+	}
 
-#define PROXY_RET(x) \
-	PROXY_NO_BACKEND \
-	return x;
+	return target;
+}
 
 #define PASS_TO_VFS(vfsop, args...) \
-	{ \
-		PROXY_INTRO \
-		return vfsop(args); \
-	}
+{ \
+	PROXY_INTRO \
+	ssize_t ret = -ENXIO; \
+	if (target) \
+		ret = vfsop(args); \
+	PROXY_OUTRO \
+	return ret; \
+}
 
 #define PASS_TO_FILE(opname, args...) \
 { \
-	PROXY_PASS_FILE(opname, args) \
+	PROXY_INTRO \
+	__typeof__(target->f_op->opname(args)) ret = -ENXIO; \
+	if (target && target->f_op->opname) { \
+		ret = target->f_op->opname(args); \
+	} else if (target) { \
+		PROXY_NO_BACKEND; \
+	} \
+	PROXY_OUTRO \
+	return ret; \
 }
 
+/*
+ * sharded entries route writes to the backend picked by the current CPU
+ * or NUMA node, others to the posted file
+ */
+#define PROXY_SHARD_INTRO \
+	struct srvfs_proxy *sp = proxy->private_data; \
+	struct file *target = proxy_check_backend(proxy, \
+				srvfs_fileref_get_shard(sp->fileref) ?: \
+				srvfs_fileref_get_file(sp->fileref));
+
+#define PROXY_SHARD_OUTRO \
+	PROXY_OUTRO
+
 /* === file operations passed directly to the backend file === */
 
 static loff_t proxy_llseek(struct file *proxy, loff_t offset, int whence)
@@ -51,7 +96,18 @@ static ssize_t proxy_read(struct file *proxy, char __user *buf, size_t len,
 
 static ssize_t proxy_write(struct file *proxy, const char __user *buf,
 			   size_t len, loff_t *offset)
-	PASS_TO_FILE(write, target, buf, len, offset);
+{
+	ssize_t ret = -EOPNOTSUPP;
+	PROXY_SHARD_INTRO
+
+	if (!target)
+		ret = -ENXIO;
+	else if (target->f_op->write)
+		ret = target->f_op->write(target, buf, len, offset);
+
+	PROXY_SHARD_OUTRO
+	return ret;
+}
 
 #ifdef CONFIG_SRVFS_VFS_READWRITE
 static ssize_t proxy_vfs_read(struct file *proxy, char __user *buf, size_t len,
@@ -60,53 +116,364 @@ static ssize_t proxy_vfs_read(struct file *proxy, char __user *buf, size_t len,
 
 static ssize_t proxy_vfs_write(struct file *proxy, const char __user *buf,
 			       size_t len, loff_t *offset)
-	PASS_TO_VFS(vfs_write, target, buf, len, offset);
+{
+	ssize_t ret = -ENXIO;
+	PROXY_SHARD_INTRO
+
+	if (target)
+		ret = vfs_write(target, buf, len, offset);
+
+	PROXY_SHARD_OUTRO
+	return ret;
+}
 #endif
 
 static long proxy_unlocked_ioctl(struct file *proxy, unsigned int cmd,
 				 unsigned long arg)
-	PASS_TO_FILE(unlocked_ioctl, target, cmd, arg);
+{
+	long ret = -ENOTTY;
+	PROXY_INTRO
+
+	/* reposts go to the entry, everything else to the backend */
+	if (cmd == SRVFS_IOC_POST)
+		ret = srvfs_file_post_ioctl(proxy, (void __user *)arg);
+	else if (target && target->f_op->unlocked_ioctl)
+		ret = target->f_op->unlocked_ioctl(target, cmd, arg);
+
+	PROXY_OUTRO
+	return ret;
+}
 
 static int proxy_fsync(struct file *proxy, loff_t start, loff_t end,
 		       int datasync)
 	PASS_TO_FILE(fsync, target, start, end, datasync);
 
+/*
+ * sendfile() and splice() into the proxy. The pages go straight to the
+ * backend: sockets take them via their own splice_write (sendpage based),
+ * backends having just sendpage get them via generic_splice_sendpage(),
+ * so we don't fall back to copying through write(). SPLICE_F_MORE is
+ * passed on as is. Sharded entries pick the shard like write() does.
+ */
 static ssize_t proxy_splice_write(struct pipe_inode_info *pipe,
 				  struct file *proxy, loff_t *ppos,
 				  size_t len, unsigned int flags)
-	PASS_TO_FILE(splice_write, pipe, target, ppos, len, flags);
+{
+	ssize_t ret;
+	PROXY_SHARD_INTRO
+
+	if (!target)
+		ret = -ENXIO;
+	else if (target->f_op->splice_write)
+		ret = target->f_op->splice_write(pipe, target, ppos, len,
+						 flags);
+	else if (target->f_op->sendpage)
+		ret = generic_splice_sendpage(pipe, target, ppos, len, flags);
+	else
+		ret = iter_file_splice_write(pipe, target, ppos, len, flags);
+
+	PROXY_SHARD_OUTRO
+	return ret;
+}
+
+/*
+ * Locks and leases have to live on the backend's inode, so they conflict
+ * with everybody else using that file, not just other proxies of the same
+ * entry. The VFS would put them onto our own inode, if we didn't have
+ * these ops, so they're always set, falling back to the generic code
+ * on the backend.
+ *
+ * A proxy's locks all go to the backend it first locked on, which stays
+ * pinned until the proxy is released, even if the entry gets reposted
+ * meanwhile. So they can always be dropped again where they were taken.
+ * Callers of proxy_locked_file() borrow the proxy's reference on it.
+ *
+ * flock() and OFD locks stay owned by the proxy (fl_owner, and fl_file
+ * for flock on the generic code), so each open of the entry is a
+ * separate lock owner, as for regular files.
+ */
+static struct file *proxy_locked_file(struct srvfs_proxy *sp)
+{
+	struct file *target;
+
+	if (READ_ONCE(sp->locked))
+		return sp->locked;
+
+	target = srvfs_fileref_get_file(sp->fileref);
+	if (target && cmpxchg(&sp->locked, NULL, target))
+		fput(target);
+
+	return READ_ONCE(sp->locked);
+}
+
+/*
+ * Leases are bound to a file on the inode they're taken on, and the lease
+ * code resets that file's owner when they go away, even on a timeout after
+ * a break (time_out_leases() calls lease_modify() directly). So they're
+ * taken on a private read-only file of the proxy, opened on its pinned
+ * backend, and never touch the backend's owner. Write leases can't be had
+ * this way, but the entry keeps the backend open anyway.
+ */
+static struct file *proxy_lease_file(struct srvfs_proxy *sp)
+{
+	struct file *target = proxy_locked_file(sp);
+	struct file *file;
+
+	if (READ_ONCE(sp->lease_file))
+		return sp->lease_file;
+	if (!target)
+		return ERR_PTR(-ENXIO);
+
+	file = dentry_open(&target->f_path, O_RDONLY, target->f_cred);
+	if (IS_ERR(file))
+		return file;
+	if (cmpxchg(&sp->lease_file, NULL, file))
+		fput(file);
+
+	return READ_ONCE(sp->lease_file);
+}
+
+/*
+ * Leases get signalled to the proxy's owner: the holder's fasync entry
+ * lives in the proxy (set up by proxy_setlease() once the lease is in
+ * place). fl_owner is the proxy, see lease_init().
+ */
+static bool proxy_lease_break(struct file_lock *fl)
+{
+	struct file *proxy = fl->fl_owner;
+	struct srvfs_proxy *sp = proxy->private_data;
+
+	kill_fasync(&sp->lease_fasync, SIGIO, POLL_MSG);
+	return false;
+}
+
+static int proxy_lease_change(struct file_lock *fl, int arg,
+			      struct list_head *dispose)
+{
+	struct file *proxy = fl->fl_owner;
+	struct srvfs_proxy *sp = proxy->private_data;
+	int ret;
+
+	ret = lease_modify(fl, arg, dispose);
+	if (!ret && (arg == F_UNLCK))
+		fasync_helper(-1, proxy, 0, &sp->lease_fasync);
+	return ret;
+}
+
+/* no lm_setup: the fasync entry can't be allocated under flc_lock */
+static const struct lock_manager_operations proxy_lease_lmops = {
+	.lm_break	= proxy_lease_break,
+	.lm_change	= proxy_lease_change,
+};
 
 static int proxy_setlease(struct file *proxy, long arg,
 			  struct file_lock ** lease, void ** priv)
-	PASS_TO_FILE(setlease, target, arg, lease, priv);
+{
+	struct srvfs_proxy *sp = proxy->private_data;
+	struct file *file = proxy_lease_file(sp);
+	struct fasync_struct *fa = NULL;
+	int ret;
+
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	/* nfsd's delegations come with their own lock manager */
+	if (lease && *lease && priv && !((*lease)->fl_flags & FL_DELEG)) {
+		fa = *priv;
+		(*lease)->fl_lmops = &proxy_lease_lmops;
+	}
+	if (lease && *lease)
+		(*lease)->fl_file = file;
+
+	ret = vfs_setlease(file, arg, lease, priv);
+	if (ret || !fa)
+		return ret;
+
+	ret = fasync_helper(fa->fa_fd, proxy, 1, &sp->lease_fasync);
+	if (ret < 0) {
+		vfs_setlease(file, F_UNLCK, NULL, (void **)&proxy);
+		return ret;
+	}
 
-/* this *might* cause trouble w/ NFSd, which wants to retrieve 
-   the conflicting lock */
+	__f_setown(proxy, task_pid(current), PIDTYPE_PID, 0);
+	return 0;
+}
+
+/*
+ * Backends with their own ->lock (NFS, CIFS, FUSE, ...) look up their
+ * per-open state from fl_file, so it has to be theirs. The generic code
+ * doesn't care, and /proc/locks shows the backend's inode then.
+ *
+ * this *might* cause trouble w/ NFSd, which wants to retrieve
+ * the conflicting lock
+ */
 static int proxy_lock(struct file *proxy, int cmd, struct file_lock *fl)
-	PASS_TO_FILE(lock, target, cmd, fl);
+{
+	struct file *target = proxy_locked_file(proxy->private_data);
+	int ret;
+
+	if (!target)
+		return -ENXIO;
+
+	fl->fl_file = target;
+	if (IS_GETLK(cmd))
+		ret = vfs_test_lock(target, fl);
+	else
+		ret = vfs_lock_file(target, cmd, fl, NULL);
+	fl->fl_file = proxy;
+
+	return ret;
+}
+
+/*
+ * The generic flock code takes fl_file as the owner, so it has to stay
+ * the proxy there. Backends with their own ->flock get theirs, as for
+ * ->lock. They tell owners apart by fl_owner (the proxy) on the server,
+ * but their local record is kept per fl_file, so it's shared by all the
+ * proxies. Thus only proxies known to hold a flock() unlock on release.
+ */
+static int proxy_flock(struct file *proxy, int cmd, struct file_lock *fl)
+{
+	struct srvfs_proxy *sp = proxy->private_data;
+	struct file *target = proxy_locked_file(sp);
+	int ret;
+
+	if (!target)
+		return -ENXIO;
+
+	if (target->f_op->flock) {
+		fl->fl_file = target;
+		ret = target->f_op->flock(target, cmd, fl);
+		fl->fl_file = proxy;
+		if (!ret)
+			WRITE_ONCE(sp->flocked, fl->fl_type != F_UNLCK);
+	} else {
+		ret = locks_lock_inode_wait(file_inode(target), fl);
+	}
+
+	return ret;
+}
+
+/*
+ * __fput() only cleans up the locks on our own inode, so drop the ones
+ * the proxy still holds on the backend it has pinned: OFD locks and
+ * flock(). Leases go away with the proxy's lease file.
+ */
+static void proxy_release_locks(struct file *proxy, struct srvfs_proxy *sp)
+{
+	struct file *target = sp->locked;
+	struct file_lock fl = {
+		.fl_owner	= proxy,
+		.fl_pid		= current->tgid,
+		.fl_file	= proxy,
+		.fl_flags	= FL_FLOCK,
+		.fl_type	= F_UNLCK,
+		.fl_end		= OFFSET_MAX,
+	};
+
+	if (!READ_ONCE(file_inode(target)->i_flctx))
+		return;
+
+	locks_remove_posix(target, proxy);
+
+	if (target->f_op->flock) {
+		if (sp->flocked) {
+			fl.fl_file = target;
+			target->f_op->flock(target, F_SETLKW, &fl);
+		}
+	} else {
+		locks_lock_inode_wait(file_inode(target), &fl);
+	}
+	if (fl.fl_ops && fl.fl_ops->fl_release_private)
+		fl.fl_ops->fl_release_private(&fl);
+}
 
 static ssize_t proxy_dedupe_file_range(struct file *proxy, u64 loff, u64 olen,
 				       struct file *dst_file, u64 dst_loff)
 	PASS_TO_FILE(dedupe_file_range, target, loff, olen, dst_file,
 		     dst_loff);
 
+/*
+ * filp_close() only drops POSIX locks on our own inode. Closing drops
+ * the ones on the current backend as well, as closing the backend would.
+ */
 static int proxy_flush(struct file *proxy, fl_owner_t id)
-	PASS_TO_FILE(flush, target, id);
+{
+	int ret = 0;
+	struct file *locked;
+	PROXY_INTRO
+
+	locked = READ_ONCE(sp->locked);
+	if (locked)
+		locks_remove_posix(locked, id);
+
+	if (!target)
+		return 0;
+
+	if (target != locked)
+		locks_remove_posix(target, id);
+
+	if (target->f_op->flush)
+		ret = target->f_op->flush(target, id);
+
+	PROXY_OUTRO
+	return ret;
+}
 
 static long proxy_compat_ioctl(struct file *proxy, unsigned int cmd,
 			       unsigned long arg)
-	PASS_TO_FILE(compat_ioctl, target, cmd, arg);
+{
+	/* let the VFS try its own translations, as without compat_ioctl */
+	long ret = -ENOIOCTLCMD;
+	PROXY_INTRO
+
+#ifdef CONFIG_COMPAT
+	if (cmd == SRVFS_IOC_POST)
+		ret = srvfs_file_post_ioctl(proxy, compat_ptr(arg));
+	else
+#endif
+	if (target && target->f_op->compat_ioctl)
+		ret = target->f_op->compat_ioctl(target, cmd, arg);
+
+	PROXY_OUTRO
+	return ret;
+}
 
 static int proxy_fasync(int fd, struct file *proxy, int on)
 	PASS_TO_FILE(fasync, fd, target, on);
 
 static ssize_t proxy_sendpage(struct file *proxy, struct page *page, int offs,
 			      size_t len, loff_t *pos, int more)
-	PASS_TO_FILE(sendpage, target, page, offs, len, pos, more);
+{
+	ssize_t ret = -EOPNOTSUPP;
+	PROXY_SHARD_INTRO
+
+	if (!target)
+		ret = -ENXIO;
+	else if (target->f_op->sendpage)
+		ret = target->f_op->sendpage(target, page, offs, len, pos,
+					     more);
+
+	PROXY_SHARD_OUTRO
+	return ret;
+}
 
 static unsigned int proxy_poll (struct file *proxy,
 				struct poll_table_struct *pt)
-	PASS_TO_FILE(poll, target, pt);
+{
+	unsigned int ret = POLLERR;
+	PROXY_INTRO
+
+	/* our reference keeps the backend's wait queues around */
+	if (target && target->f_op->poll) {
+		ret = srvfs_poll(sp->fileref, proxy, target, pt);
+	} else if (target) {
+		PROXY_NO_BACKEND;
+	}
+
+	PROXY_OUTRO
+	return ret;
+}
 
 static ssize_t proxy_copy_file_range(struct file *proxy, loff_t pos_in,
 	struct file *file_out, loff_t pos_out, size_t size, unsigned int flags)
@@ -123,17 +490,44 @@ static long proxy_fallocate(struct file *proxy, int mode, loff_t offset,
 			    loff_t len)
 	PASS_TO_FILE(fallocate, target, mode, offset, len);
 
+/*
+ * The mapping has to be the backend's one: if vm_file stayed the proxy,
+ * faults would go to our own inode's empty page cache. So the vma gets
+ * handed over to the backend, as stacking filesystems do.
+ */
 static int proxy_mmap(struct file *proxy, struct vm_area_struct *vma)
-	PASS_TO_FILE(mmap, target, vma);
+{
+	int ret;
+	PROXY_INTRO
+
+	if (!target)
+		return -ENXIO;
+
+	if (WARN_ON(vma->vm_file != proxy)) {
+		fput(target);
+		return -EIO;
+	}
+
+	/* the vma takes over our reference */
+	vma->vm_file = target;
+	ret = target->f_op->mmap(target, vma);
+	if (ret) {
+		/* mmap_region() drops its reference on the proxy itself */
+		vma->vm_file = proxy;
+		fput(target);
+		return ret;
+	}
+
+	/* the vma now holds the backend instead of the proxy */
+	fput(proxy);
+	return 0;
+}
 
 #ifndef CONFIG_MMU
 static unsigned proxy_mmap_capabilities(struct file *proxy)
 	PASS_TO_FILE(mmap_capabilities, target);
 #endif /* CONFIG_MMU */
 
-static int proxy_flock(struct file *proxy, int flags, struct file_lock *fl)
-	PASS_TO_FILE(flock, target, flags, fl);
-
 static unsigned long proxy_get_unmapped_area(struct file *proxy,
 					     unsigned long orig_addr,
 					     unsigned long len,
@@ -157,9 +551,12 @@ static int proxy_iterate_shared(struct file *proxy, struct dir_context *ctx)
 static void proxy_show_fdinfo(struct seq_file *m, struct file *proxy)
 {
 	PROXY_INTRO
-	if (target->f_op->show_fdinfo)
-		return target->f_op->show_fdinfo(m, target);
-	PROXY_NO_BACKEND
+	if (target && target->f_op->show_fdinfo) {
+		target->f_op->show_fdinfo(m, target);
+	} else if (target) {
+		PROXY_NO_BACKEND;
+	}
+	PROXY_OUTRO
 }
 
 static int proxy_open(struct inode *inode, struct file *proxy)
@@ -170,11 +567,31 @@ static int proxy_open(struct inode *inode, struct file *proxy)
 	return -EINVAL;
 }
 
+static void srvfs_fops_put_proxy(struct srvfs_fileref *fileref,
+				 struct srvfs_fops *fops);
+
 static int proxy_release(struct inode *inode, struct file *proxy)
 {
-	PROXY_INTRO
+	struct srvfs_fops *fops = srvfs_proxy_fops(proxy);
+	struct srvfs_proxy *sp = proxy->private_data;
 	(void)(inode);
-	srvfs_fileref_put(fileref);
+
+	/* before the lease file's deferred fput(), as lm_break needs sp */
+	if (sp->lease_file) {
+		vfs_setlease(sp->lease_file, F_UNLCK, NULL, (void **)&proxy);
+		fput(sp->lease_file);
+	}
+	if (sp->locked) {
+		proxy_release_locks(proxy, sp);
+		fput(sp->locked);
+	}
+	fasync_helper(-1, proxy, 0, &sp->lease_fasync);
+
+	/* __fput() still needs f_op->owner after we've dropped the table */
+	proxy->f_op = &srvfs_file_ops;
+	srvfs_fops_put_proxy(sp->fileref, fops);
+	srvfs_fileref_put(sp->fileref);
+	kfree(sp);
 	return 0;
 }
 
@@ -185,6 +602,9 @@ static ssize_t proxy_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 	struct file *proxy = iocb->ki_filp;
 	PROXY_INTRO
 
+	if (!target)
+		return -ENXIO;
+
 	/* create a kiocb for the target file */
 	init_sync_kiocb(&target_iocb, target);
 	target_iocb.ki_pos = iocb->ki_pos;
@@ -197,6 +617,7 @@ static ssize_t proxy_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 	/* write back to proxy iocb */
 	iocb->ki_pos = target_iocb.ki_pos;
 
+	PROXY_OUTRO
 	return ret;
 }
 
@@ -205,7 +626,10 @@ static ssize_t proxy_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 	ssize_t ret;
 	struct file *proxy = iocb->ki_filp;
 	struct kiocb target_iocb;
-	PROXY_INTRO
+	PROXY_SHARD_INTRO
+
+	if (!target)
+		return -ENXIO;
 
 	/* create a kiocb for the target file */
 	init_sync_kiocb(&target_iocb, target);
@@ -219,6 +643,7 @@ static ssize_t proxy_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 	/* write back to proxy iocb */
 	iocb->ki_pos = target_iocb.ki_pos;
 
+	PROXY_SHARD_OUTRO
 	return ret;
 }
 
@@ -231,37 +656,113 @@ static int proxy_check_flags(int flags)
 	PROXY_INTRO
 	if (target->f_op->check_flags)
 		return target->f_op->check_flags(target, flags);
-	PROXY_RET(-EOPNOTSUPP);
+	PROXY_NO_BACKEND;
+	return -EOPNOTSUPP;
 }
 */
 
 #define STR(s) #s
 
 #define COPY_FILEOP(opname) \
-	if (fileref->file->f_op->opname) { \
-		pr_info("assigning " STR(opname) " ptr=%pF\n", fileref->file->f_op->opname); \
-		fileref->f_ops.opname = proxy_##opname; \
+	if (target->f_op->opname) { \
+		pr_debug("assigning " STR(opname) " ptr=%pF\n", target->f_op->opname); \
+		f_ops.opname = proxy_##opname; \
 	} else { \
-		pr_info("assigning " STR(opname) " <NULL>\n"); \
-		fileref->f_ops.opname = NULL; \
+		pr_debug("assigning " STR(opname) " <NULL>\n"); \
+		f_ops.opname = NULL; \
 	}
 
 #define TEST_FILEOP(opname) \
-	if (fileref->file->f_op->opname) { \
-		pr_info("got valid file operation " STR(opname) " ptr=%pF\n", fileref->file->f_op->opname); \
+	if (target->f_op->opname) { \
+		pr_debug("got valid file operation " STR(opname) " ptr=%pF\n", target->f_op->opname); \
 	} else { \
-		pr_info("got NULL file operation " STR(opname) "\n"); \
+		pr_debug("got NULL file operation " STR(opname) "\n"); \
 	}
 
 #define SET_FILEOP(opname) \
-	fileref->f_ops.opname = proxy_##opname;
+	f_ops.opname = proxy_##opname;
 
-void srvfs_proxy_fill_fops(struct file *file)
+/* === proxy fops tables === */
+
+static void srvfs_fops_release(struct kref *ref)
 {
-	struct srvfs_fileref *fileref = file->private_data;
+	struct srvfs_fops *fops = container_of(ref, struct srvfs_fops,
+					       refcount);
 
-	memset(&fileref->f_ops, 0, sizeof(fileref->f_ops));
-	fileref->f_ops.owner = THIS_MODULE;
+	/* might still be looked up from the fileref's cache */
+	kfree_rcu(fops, rcu);
+}
+
+/* true if that was the last reference */
+bool srvfs_fops_put(struct srvfs_fops *fops)
+{
+	return fops && kref_put(&fops->refcount, srvfs_fops_release);
+}
+
+/* the table a proxy is running on, NULL if it's no proxy (yet) */
+static struct srvfs_fops *srvfs_proxy_fops(struct file *proxy)
+{
+	if (proxy->f_op == &srvfs_file_ops)
+		return NULL;
+
+	return container_of(proxy->f_op, struct srvfs_fops, f_ops);
+}
+
+static struct srvfs_fops *srvfs_fops_get_cached(struct srvfs_fileref *fileref,
+						struct file *target)
+{
+	struct srvfs_fops *fops;
+
+	rcu_read_lock();
+	fops = READ_ONCE(fileref->fops);
+	if (fops && ((fops->backend != target->f_op) ||
+		     !kref_get_unless_zero(&fops->refcount)))
+		fops = NULL;
+	rcu_read_unlock();
+
+	return fops;
+}
+
+/* the opening proxy uses it, so it's not idle yet */
+static void srvfs_fops_cache(struct srvfs_fileref *fileref,
+			     struct srvfs_fops *fops)
+{
+	kref_get(&fops->refcount);
+	srvfs_fops_put(xchg(&fileref->fops, fops));
+}
+
+/*
+ * A proxy lets go of its table. Once the last proxy using the entry's
+ * cached table is gone, the entry goes onto the mount's idle list, for
+ * the shrinker.
+ */
+static void srvfs_fops_put_proxy(struct srvfs_fileref *fileref,
+				 struct srvfs_fops *fops)
+{
+	struct srvfs_sb *sbpriv = fileref->sbpriv;
+
+	if (sbpriv && fops && (READ_ONCE(fileref->fops) == fops) &&
+	    (kref_read(&fops->refcount) == 2) &&
+	    list_empty(&fileref->fops_node)) {
+		spin_lock(&sbpriv->fops_lock);
+		if ((fileref->fops == fops) &&
+		    list_empty(&fileref->fops_node)) {
+			list_add_tail(&fileref->fops_node, &sbpriv->fops_list);
+			atomic_long_inc(&sbpriv->nr_idle_fops);
+		}
+		spin_unlock(&sbpriv->fops_lock);
+	}
+
+	srvfs_fops_put(fops);
+}
+
+static void srvfs_fops_build(struct file_operations *table,
+			     struct file *target)
+{
+	struct file_operations f_ops;
+
+	memset(&f_ops, 0, sizeof(f_ops));
+	f_ops.owner = THIS_MODULE;
 
 	SET_FILEOP(open);
 	SET_FILEOP(release);
@@ -272,17 +773,20 @@ void srvfs_proxy_fill_fops(struct file *file)
 	COPY_FILEOP(fsync);
 	COPY_FILEOP(fasync);
 	COPY_FILEOP(poll);
-	COPY_FILEOP(unlocked_ioctl);
-	COPY_FILEOP(compat_ioctl);
+	SET_FILEOP(unlocked_ioctl);
+	SET_FILEOP(compat_ioctl);
 	COPY_FILEOP(mmap);
-	COPY_FILEOP(flush);
-	COPY_FILEOP(lock);
+	SET_FILEOP(flush);
+	SET_FILEOP(lock);
 	COPY_FILEOP(sendpage);
 	COPY_FILEOP(get_unmapped_area);
-	COPY_FILEOP(flock);
-	COPY_FILEOP(splice_write);
+	SET_FILEOP(flock);
+	if (target->f_op->splice_write || target->f_op->sendpage ||
+	    target->f_op->write_iter) {
+		SET_FILEOP(splice_write);
+	}
 	COPY_FILEOP(splice_read);
-	COPY_FILEOP(setlease);
+	SET_FILEOP(setlease);
 	COPY_FILEOP(fallocate);
 	COPY_FILEOP(show_fdinfo);
 	COPY_FILEOP(copy_file_range);
@@ -297,13 +801,98 @@ void srvfs_proxy_fill_fops(struct file *file)
 #endif
 
 #ifdef CONFIG_SRVFS_VFS_READWRITE
-	if (!fileref->f_ops.read)
-		fileref->f_ops.read = proxy_vfs_read;
-	if (!fileref->f_ops.write)
-		fileref->f_ops.write = proxy_vfs_write;
+	if (!f_ops.read)
+		f_ops.read = proxy_vfs_read;
+	if (!f_ops.write)
+		f_ops.write = proxy_vfs_write;
 #endif
 
 	TEST_FILEOP(check_flags);
 
-	file->f_op = &fileref->f_ops;
+	memcpy(table, &f_ops, sizeof(f_ops));
+}
+
+/*
+ * Proxies of the same entry share their fops table, as long as the
+ * backend is of the same kind. A table is never modified once it's been
+ * published, so proxies right in some operation never see it changing.
+ */
+int srvfs_proxy_fill_fops(struct file *file, struct srvfs_fileref *fileref)
+{
+	struct file *target = srvfs_fileref_get_file(fileref);
+	struct srvfs_fops *fops, *old;
+
+	if (!target)
+		return 0;
+
+	fops = srvfs_fops_get_cached(fileref, target);
+	if (!fops) {
+		fops = kmalloc(sizeof(struct srvfs_fops), GFP_KERNEL_ACCOUNT);
+		if (!fops) {
+			fput(target);
+			return -ENOMEM;
+		}
+
+		kref_init(&fops->refcount);
+		fops->backend = target->f_op;
+		srvfs_fops_build(&fops->f_ops, target);
+		srvfs_fops_cache(fileref, fops);
+	}
+	fput(target);
+
+	old = srvfs_proxy_fops(file);
+	file->f_op = &fops->f_ops;
+	srvfs_fops_put_proxy(fileref, old);
+	return 0;
+}
+
+/*
+ * Make a freshly opened entry a proxy of its backend, taking over the
+ * reference on @fileref. It stays a control file if the entry has been
+ * emptied meanwhile.
+ *
+ * Opening for write breaks the leases on the backend, as opening the
+ * backend itself would: the VFS only breaks those on our own inode.
+ */
+int srvfs_proxy_open(struct file *file, struct srvfs_fileref *fileref)
+{
+	struct srvfs_proxy *sp;
+	struct file *target;
+	int ret;
+
+	if (file->f_mode & FMODE_WRITE) {
+		target = srvfs_fileref_get_file(fileref);
+		if (target) {
+			ret = break_lease(file_inode(target), file->f_flags);
+			fput(target);
+			if (ret)
+				return ret;
+		}
+	}
+
+	sp = kzalloc(sizeof(struct srvfs_proxy), GFP_KERNEL_ACCOUNT);
+	if (!sp)
+		return -ENOMEM;
+
+	ret = srvfs_proxy_fill_fops(file, fileref);
+	if (ret || !srvfs_proxy_fops(file)) {
+		kfree(sp);
+		return ret;
+	}
+
+	sp->fileref = fileref;
+	file->private_data = sp;
+	return 0;
+}
+
+/* the fileref an open srvfs file refers to, proxies may have their own */
+struct srvfs_fileref *srvfs_file_fileref(struct file *file)
+{
+	struct srvfs_proxy *sp;
+
+	if (!srvfs_proxy_fops(file))
+		return file->private_data;
+
+	sp = file->private_data;
+	return sp->fileref;
 }
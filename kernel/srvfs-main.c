@@ -12,7 +12,7 @@ struct dentry *srvfs_mount(struct file_system_type *fs_type,
 	return mount_nodev(fs_type, flags, data, srvfs_fill_super);
 }
 
-static struct file_system_type srvfs_type = {
+struct file_system_type srvfs_type = {
 	.owner 		= THIS_MODULE,
 	.name		= "srvfs",
 	.mount		= srvfs_mount,
@@ -21,13 +21,32 @@ static struct file_system_type srvfs_type = {
 
 static int __init srvfs_init(void)
 {
+	int ret;
+
+	ret = srvfs_fileref_cache_init();
+	if (ret)
+		return ret;
+
+	ret = srvfs_selftest();
+	if (ret) {
+		srvfs_fileref_cache_exit();
+		return ret;
+	}
+
+	ret = register_filesystem(&srvfs_type);
+	if (ret) {
+		srvfs_fileref_cache_exit();
+		return ret;
+	}
+
 	pr_info("srvfs: loaded\n");
-	return register_filesystem(&srvfs_type);
+	return 0;
 }
 
 static void __exit srvfs_exit(void)
 {
 	unregister_filesystem(&srvfs_type);
+	srvfs_fileref_cache_exit();
 	pr_info("srvfs: unloaded\n");
 }
 
@@ -0,0 +1,706 @@
+/*
+ * Self tests for the fileref lifecycle and proxy dispatch
+ *
+ * Built into the module with "make SRVFS_SELFTEST=1", against the same
+ * kernel as the rest of the module. The tests run once when the module
+ * gets loaded, before the filesystem is registered; insmod fails if any
+ * of them fails. Results go to the kernel log.
+ *
+ * The tests run against private in-kernel mounts and use anon inode files
+ * as backends, so they don't need any hardware and run fine under UML or
+ * QEMU. The timing cases don't assert anything, they just log ns/op as a
+ * baseline for performance work on the proxy hot path.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": selftest: " fmt
+
+#include "srvfs.h"
+
+#include <linux/anon_inodes.h>
+#include <linux/completion.h>
+#include <linux/cred.h>
+#include <linux/delay.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/mount.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+#define SELFTEST_RELEASE_TIMEOUT	(5 * HZ)
+#define SELFTEST_BENCH_LOOPS		100000
+#define SELFTEST_RACE_LOOPS		10000
+#define SELFTEST_RACE_THREADS		4
+
+struct selftest {
+	const char *name;
+	struct vfsmount *mnt;
+	struct list_head backends;
+	int failed;
+};
+
+static bool selftest_check(struct selftest *test, bool ok, const char *what,
+			   int line)
+{
+	if (!ok) {
+		pr_err("%s: line %d: %s failed\n", test->name, line, what);
+		test->failed++;
+	}
+	return ok;
+}
+
+#define SELFTEST_EXPECT(test, cond) \
+	selftest_check(test, (cond), #cond, __LINE__)
+
+/* bails out of the test case, leaving the cleanup to selftest_run() */
+#define SELFTEST_ASSERT(test, cond) \
+	do { \
+		if (!SELFTEST_EXPECT(test, cond)) \
+			return; \
+	} while (0)
+
+/* === backend files === */
+
+struct selftest_backend {
+	struct list_head list;
+	struct file *file;
+	atomic_t released;
+	struct completion done;
+};
+
+static ssize_t selftest_backend_read_iter(struct kiocb *iocb,
+					  struct iov_iter *to)
+{
+	size_t len = iov_iter_count(to);
+
+	iov_iter_advance(to, len);
+	iocb->ki_pos += len;
+	return len;
+}
+
+static ssize_t selftest_backend_write_iter(struct kiocb *iocb,
+					   struct iov_iter *from)
+{
+	size_t len = iov_iter_count(from);
+
+	iov_iter_advance(from, len);
+	iocb->ki_pos += len;
+	return len;
+}
+
+static int selftest_backend_release(struct inode *inode, struct file *file)
+{
+	struct selftest_backend *be = file->private_data;
+
+	atomic_inc(&be->released);
+	complete(&be->done);
+	return 0;
+}
+
+static const struct file_operations selftest_backend_fops = {
+	.owner		= THIS_MODULE,
+	.read_iter	= selftest_backend_read_iter,
+	.write_iter	= selftest_backend_write_iter,
+	.llseek		= noop_llseek,
+	.release	= selftest_backend_release,
+};
+
+static struct selftest_backend *selftest_backend_new(struct selftest *test)
+{
+	struct selftest_backend *be;
+
+	be = kzalloc(sizeof(*be), GFP_KERNEL);
+	if (!SELFTEST_EXPECT(test, be))
+		return NULL;
+
+	init_completion(&be->done);
+	be->file = anon_inode_getfile("srvfs-selftest", &selftest_backend_fops,
+				      be, O_RDWR);
+	if (!SELFTEST_EXPECT(test, !IS_ERR(be->file))) {
+		kfree(be);
+		return NULL;
+	}
+
+	list_add(&be->list, &test->backends);
+	return be;
+}
+
+/* fput() is deferred, so wait for it */
+static bool selftest_backend_wait(struct selftest_backend *be)
+{
+	return wait_for_completion_timeout(&be->done,
+					   SELFTEST_RELEASE_TIMEOUT);
+}
+
+/* === private srvfs mount === */
+
+static struct dentry *selftest_entry_new(struct selftest *test,
+					 const char *name)
+{
+	struct dentry *dentry;
+
+	dentry = d_alloc_name(test->mnt->mnt_root, name);
+	if (!SELFTEST_EXPECT(test, dentry))
+		return NULL;
+
+	if (!SELFTEST_EXPECT(test,
+			     !srvfs_insert_file(test->mnt->mnt_sb, dentry)))
+		return NULL;
+
+	return dentry;
+}
+
+static struct file *selftest_entry_open(struct selftest *test,
+					struct dentry *dentry)
+{
+	struct path path = { .mnt = test->mnt, .dentry = dentry };
+	struct file *file;
+
+	file = dentry_open(&path, O_RDWR, current_cred());
+	if (!SELFTEST_EXPECT(test, !IS_ERR(file)))
+		return NULL;
+
+	return file;
+}
+
+static struct srvfs_fileref *selftest_entry_fileref(struct dentry *dentry)
+{
+	return d_inode(dentry)->i_private;
+}
+
+/* === fileref lifecycle === */
+
+static void srvfs_test_fileref_get_put(struct selftest *test)
+{
+	struct selftest_backend *be = selftest_backend_new(test);
+	struct srvfs_fileref *fileref = srvfs_fileref_new(NULL);
+	int i;
+
+	SELFTEST_ASSERT(test, be && fileref);
+	SELFTEST_EXPECT(test, kref_read(&fileref->refcount) == 1);
+
+	srvfs_fileref_set(fileref, be->file);
+
+	for (i = 0; i < 16; i++)
+		srvfs_fileref_get(fileref);
+	SELFTEST_EXPECT(test, kref_read(&fileref->refcount) == 17);
+
+	for (i = 0; i < 16; i++)
+		srvfs_fileref_put(fileref);
+	SELFTEST_EXPECT(test, kref_read(&fileref->refcount) == 1);
+	SELFTEST_EXPECT(test, atomic_read(&be->released) == 0);
+
+	srvfs_fileref_put(fileref);
+	SELFTEST_EXPECT(test, selftest_backend_wait(be));
+	SELFTEST_EXPECT(test, atomic_read(&be->released) == 1);
+}
+
+static void srvfs_test_fileref_set(struct selftest *test)
+{
+	struct selftest_backend *a = selftest_backend_new(test);
+	struct selftest_backend *b = selftest_backend_new(test);
+	struct srvfs_fileref *fileref = srvfs_fileref_new(NULL);
+
+	SELFTEST_ASSERT(test, a && b && fileref);
+
+	srvfs_fileref_set(fileref, a->file);
+	SELFTEST_EXPECT(test, fileref->file == a->file);
+
+	/* repost drops the old backend */
+	srvfs_fileref_set(fileref, b->file);
+	SELFTEST_EXPECT(test, fileref->file == b->file);
+	SELFTEST_EXPECT(test, selftest_backend_wait(a));
+	SELFTEST_EXPECT(test, atomic_read(&b->released) == 0);
+
+	/* posting NULL detaches */
+	srvfs_fileref_set(fileref, NULL);
+	SELFTEST_EXPECT(test, !fileref->file);
+	SELFTEST_EXPECT(test, selftest_backend_wait(b));
+
+	srvfs_fileref_put(fileref);
+	SELFTEST_EXPECT(test, atomic_read(&a->released) == 1);
+	SELFTEST_EXPECT(test, atomic_read(&b->released) == 1);
+}
+
+static void srvfs_test_fileref_shards(struct selftest *test)
+{
+	struct selftest_backend *a = selftest_backend_new(test);
+	struct selftest_backend *b = selftest_backend_new(test);
+	struct srvfs_fileref *fileref = srvfs_fileref_new(NULL);
+	struct srvfs_shards *shards;
+	struct file *shard;
+
+	SELFTEST_ASSERT(test, a && b && fileref);
+	SELFTEST_EXPECT(test, !srvfs_fileref_get_shard(fileref));
+
+	shards = srvfs_shards_new(NULL, 2, SRVFS_POST_SHARD_CPU);
+	SELFTEST_ASSERT(test, !IS_ERR(shards));
+	shards->files[shards->nfiles++] = a->file;
+	shards->files[shards->nfiles++] = b->file;
+
+	/* everything but writes goes to the first shard */
+	srvfs_fileref_set_shards(fileref, shards);
+	SELFTEST_EXPECT(test, fileref->file == a->file);
+
+	shard = srvfs_fileref_get_shard(fileref);
+	SELFTEST_EXPECT(test, (shard == a->file) || (shard == b->file));
+	if (shard)
+		fput(shard);
+
+	/* a plain post drops the shards */
+	srvfs_fileref_set(fileref, NULL);
+	SELFTEST_EXPECT(test, !srvfs_fileref_get_shard(fileref));
+	SELFTEST_EXPECT(test, selftest_backend_wait(a));
+	SELFTEST_EXPECT(test, selftest_backend_wait(b));
+
+	srvfs_fileref_put(fileref);
+}
+
+static void srvfs_test_fileref_eviction(struct selftest *test)
+{
+	struct selftest_backend *be = selftest_backend_new(test);
+	struct dentry *dentry = selftest_entry_new(test, "evict");
+	struct srvfs_fileref *fileref;
+	struct file *proxy;
+
+	SELFTEST_ASSERT(test, be && dentry);
+	fileref = selftest_entry_fileref(dentry);
+	srvfs_fileref_set(fileref, be->file);
+
+	/* an open proxy keeps the fileref alive */
+	proxy = selftest_entry_open(test, dentry);
+	SELFTEST_ASSERT(test, proxy);
+	SELFTEST_EXPECT(test, kref_read(&fileref->refcount) == 2);
+
+	/* the inode goes away on unmount, the open proxy keeps the backend */
+	kern_unmount(test->mnt);
+	test->mnt = kern_mount(&srvfs_type);
+	SELFTEST_EXPECT(test, !IS_ERR(test->mnt));
+	SELFTEST_EXPECT(test, atomic_read(&be->released) == 0);
+
+	fput(proxy);
+	SELFTEST_EXPECT(test, selftest_backend_wait(be));
+	SELFTEST_EXPECT(test, atomic_read(&be->released) == 1);
+}
+
+/* === post resolution === */
+
+static void srvfs_test_resolve(struct selftest *test)
+{
+	struct selftest_backend *be = selftest_backend_new(test);
+	struct dentry *a = selftest_entry_new(test, "a");
+	struct dentry *b = selftest_entry_new(test, "b");
+	struct file *fa, *fb, *res;
+
+	SELFTEST_ASSERT(test, be && a && b);
+
+	/* plain files resolve to themselves */
+	res = srvfs_resolve_file(selftest_entry_fileref(a), get_file(be->file));
+	SELFTEST_EXPECT(test, res == be->file);
+	if (!IS_ERR(res))
+		fput(res);
+
+	/* unassigned entries can't be posted */
+	fb = selftest_entry_open(test, b);
+	SELFTEST_ASSERT(test, fb);
+	res = srvfs_resolve_file(selftest_entry_fileref(a), fb);
+	SELFTEST_EXPECT(test, PTR_ERR_OR_ZERO(res) == -EINVAL);
+
+	/* posting an srvfs entry resolves to its backend */
+	srvfs_fileref_set(selftest_entry_fileref(b), get_file(be->file));
+	fb = selftest_entry_open(test, b);
+	SELFTEST_ASSERT(test, fb);
+	res = srvfs_resolve_file(selftest_entry_fileref(a), fb);
+	SELFTEST_EXPECT(test, res == be->file);
+	if (!IS_ERR(res))
+		srvfs_fileref_set(selftest_entry_fileref(a), res);
+
+	/* posting an entry into itself loops */
+	fa = selftest_entry_open(test, a);
+	SELFTEST_ASSERT(test, fa);
+	res = srvfs_resolve_file(selftest_entry_fileref(a), fa);
+	SELFTEST_EXPECT(test, PTR_ERR_OR_ZERO(res) == -ELOOP);
+
+	fput(be->file);
+}
+
+/* === proxy dispatch === */
+
+static void srvfs_test_proxy_fill_fops(struct selftest *test)
+{
+	struct selftest_backend *be = selftest_backend_new(test);
+	struct dentry *dentry = selftest_entry_new(test, "fops");
+	struct srvfs_fileref *fileref;
+	struct file *proxy, *other;
+
+	SELFTEST_ASSERT(test, be && dentry);
+	fileref = selftest_entry_fileref(dentry);
+	srvfs_fileref_set(fileref, be->file);
+	proxy = selftest_entry_open(test, dentry);
+	SELFTEST_ASSERT(test, proxy);
+
+	SELFTEST_ASSERT(test, fileref->fops);
+	SELFTEST_EXPECT(test, proxy->f_op == &fileref->fops->f_ops);
+	SELFTEST_EXPECT(test, proxy->f_op->read_iter);
+	SELFTEST_EXPECT(test, proxy->f_op->write_iter);
+	SELFTEST_EXPECT(test, proxy->f_op->release);
+	SELFTEST_EXPECT(test, !proxy->f_op->mmap);
+	/* always there for reposting */
+	SELFTEST_EXPECT(test, proxy->f_op->unlocked_ioctl);
+
+	/* proxies of the same backend share the table */
+	other = selftest_entry_open(test, dentry);
+	if (other) {
+		SELFTEST_EXPECT(test, other->f_op == proxy->f_op);
+		fput(other);
+	}
+
+	fput(proxy);
+}
+
+static void srvfs_test_proxy_fops_reclaim(struct selftest *test)
+{
+	struct selftest_backend *be = selftest_backend_new(test);
+	struct dentry *dentry = selftest_entry_new(test, "reclaim");
+	struct srvfs_fileref *fileref;
+	struct file *proxy, *other;
+	int i;
+
+	SELFTEST_ASSERT(test, be && dentry);
+	fileref = selftest_entry_fileref(dentry);
+	srvfs_fileref_set(fileref, get_file(be->file));
+	proxy = selftest_entry_open(test, dentry);
+	SELFTEST_ASSERT(test, proxy);
+
+	/* the proxy keeps its table, the entry rebuilds on next open */
+	SELFTEST_EXPECT(test, srvfs_fileref_drop_fops(fileref));
+	SELFTEST_EXPECT(test, !srvfs_fileref_drop_fops(fileref));
+	SELFTEST_EXPECT(test, !fileref->fops);
+	SELFTEST_EXPECT(test, list_empty(&fileref->fops_node));
+	SELFTEST_EXPECT(test, proxy->f_op->read_iter);
+
+	other = selftest_entry_open(test, dentry);
+	if (other) {
+		SELFTEST_EXPECT(test, fileref->fops);
+		SELFTEST_EXPECT(test, fileref->fops &&
+				(other->f_op == &fileref->fops->f_ops));
+		/* in use, so not reclaimable */
+		SELFTEST_EXPECT(test, list_empty(&fileref->fops_node));
+		SELFTEST_EXPECT(test, !srvfs_sb_drop_fops(fileref->sbpriv, 8));
+		SELFTEST_EXPECT(test, fileref->fops);
+		fput(other);
+
+		/* the shrinker finds it once its last proxy is gone */
+		for (i = 0; list_empty(&fileref->fops_node) && (i < 100); i++)
+			msleep(10);
+		SELFTEST_EXPECT(test,
+				srvfs_sb_drop_fops(fileref->sbpriv, 1) == 1);
+		SELFTEST_EXPECT(test, !fileref->fops);
+	}
+
+	/* the posted file is never dropped */
+	SELFTEST_EXPECT(test, fileref->file == be->file);
+
+	fput(proxy);
+	fput(be->file);
+}
+
+static ssize_t selftest_read(struct file *file, char *buf, size_t len)
+{
+	struct kvec kvec = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
+	struct kiocb kiocb;
+
+	init_sync_kiocb(&kiocb, file);
+	iov_iter_kvec(&iter, ITER_KVEC | READ, &kvec, 1, len);
+	return file->f_op->read_iter(&kiocb, &iter);
+}
+
+static u64 selftest_time_reads(struct file *file, char *buf, size_t len)
+{
+	u64 start = ktime_get_ns();
+	int i;
+
+	for (i = 0; i < SELFTEST_BENCH_LOOPS; i++)
+		selftest_read(file, buf, len);
+
+	return (ktime_get_ns() - start) / SELFTEST_BENCH_LOOPS;
+}
+
+static void srvfs_test_bench_dispatch(struct selftest *test)
+{
+	struct selftest_backend *be = selftest_backend_new(test);
+	struct dentry *dentry = selftest_entry_new(test, "dispatch");
+	struct file *proxy;
+	u64 direct, proxied;
+	char buf[64];
+
+	SELFTEST_ASSERT(test, be && dentry);
+	srvfs_fileref_set(selftest_entry_fileref(dentry), get_file(be->file));
+	proxy = selftest_entry_open(test, dentry);
+	SELFTEST_ASSERT(test, proxy);
+
+	SELFTEST_EXPECT(test, selftest_read(proxy, buf, sizeof(buf)) ==
+			sizeof(buf));
+
+	direct = selftest_time_reads(be->file, buf, sizeof(buf));
+	proxied = selftest_time_reads(proxy, buf, sizeof(buf));
+
+	pr_info("%s: read_iter: direct %llu ns/op, proxied %llu ns/op\n",
+		test->name, direct, proxied);
+
+	fput(proxy);
+	fput(be->file);
+}
+
+static void srvfs_test_bench_fill_fops(struct selftest *test)
+{
+	struct selftest_backend *be = selftest_backend_new(test);
+	struct dentry *dentry = selftest_entry_new(test, "fill");
+	struct file *proxy;
+	struct srvfs_fileref *fileref;
+	u64 start;
+	int i;
+
+	SELFTEST_ASSERT(test, be && dentry);
+	fileref = selftest_entry_fileref(dentry);
+	srvfs_fileref_set(fileref, get_file(be->file));
+	proxy = selftest_entry_open(test, dentry);
+	SELFTEST_ASSERT(test, proxy);
+
+	/* dropping the cached table makes each call build a new one */
+	start = ktime_get_ns();
+	for (i = 0; i < SELFTEST_BENCH_LOOPS; i++) {
+		srvfs_fileref_drop_fops(fileref);
+		srvfs_proxy_fill_fops(proxy, fileref);
+	}
+
+	pr_info("%s: srvfs_proxy_fill_fops (build): %llu ns/op\n",
+		test->name, (ktime_get_ns() - start) / SELFTEST_BENCH_LOOPS);
+
+	start = ktime_get_ns();
+	for (i = 0; i < SELFTEST_BENCH_LOOPS; i++)
+		srvfs_proxy_fill_fops(proxy, fileref);
+
+	pr_info("%s: srvfs_proxy_fill_fops (cached): %llu ns/op\n",
+		test->name, (ktime_get_ns() - start) / SELFTEST_BENCH_LOOPS);
+
+	fput(proxy);
+	fput(be->file);
+}
+
+/* === races between repost, open and release === */
+
+struct selftest_race {
+	struct selftest *test;
+	struct dentry *entry;
+	struct dentry *other;
+	struct selftest_backend *be[2];
+	atomic_t running;
+	struct completion done;
+};
+
+static void selftest_race_finish(struct selftest_race *race)
+{
+	if (atomic_dec_and_test(&race->running))
+		complete(&race->done);
+}
+
+static int selftest_race_repost(void *data)
+{
+	struct selftest_race *race = data;
+	struct srvfs_fileref *fileref = selftest_entry_fileref(race->entry);
+	int i;
+
+	for (i = 0; i < SELFTEST_RACE_LOOPS; i++)
+		srvfs_fileref_set(fileref, get_file(race->be[i & 1]->file));
+
+	selftest_race_finish(race);
+	return 0;
+}
+
+static int selftest_race_open(void *data)
+{
+	struct selftest_race *race = data;
+	struct path path = { .mnt = race->test->mnt, .dentry = race->entry };
+	struct file *file;
+	int i;
+
+	for (i = 0; i < SELFTEST_RACE_LOOPS; i++) {
+		file = dentry_open(&path, O_RDWR, current_cred());
+		if (!IS_ERR(file))
+			fput(file);
+	}
+
+	selftest_race_finish(race);
+	return 0;
+}
+
+static int selftest_race_resolve(void *data)
+{
+	struct selftest_race *race = data;
+	struct path path = { .mnt = race->test->mnt, .dentry = race->entry };
+	struct srvfs_fileref *other = selftest_entry_fileref(race->other);
+	struct file *file;
+	int i;
+
+	for (i = 0; i < SELFTEST_RACE_LOOPS; i++) {
+		file = dentry_open(&path, O_RDWR, current_cred());
+		if (IS_ERR(file))
+			continue;
+
+		file = srvfs_resolve_file(other, file);
+		if (!IS_ERR(file))
+			fput(file);
+	}
+
+	selftest_race_finish(race);
+	return 0;
+}
+
+static void srvfs_test_race(struct selftest *test)
+{
+	int (*fns[])(void *) = {
+		selftest_race_repost, selftest_race_open, selftest_race_resolve,
+	};
+	struct selftest_race race = { .test = test };
+	struct srvfs_fileref *fileref;
+	struct task_struct *task;
+	int i;
+
+	race.entry = selftest_entry_new(test, "race");
+	race.other = selftest_entry_new(test, "other");
+	race.be[0] = selftest_backend_new(test);
+	race.be[1] = selftest_backend_new(test);
+	SELFTEST_ASSERT(test, race.entry && race.other &&
+			race.be[0] && race.be[1]);
+	fileref = selftest_entry_fileref(race.entry);
+	init_completion(&race.done);
+
+	/* one extra, so the threads can't finish before all are started */
+	atomic_set(&race.running, SELFTEST_RACE_THREADS * ARRAY_SIZE(fns) + 1);
+	for (i = 0; i < SELFTEST_RACE_THREADS * ARRAY_SIZE(fns); i++) {
+		task = kthread_run(fns[i % ARRAY_SIZE(fns)], &race,
+				   "srvfs-selftest-%d", i);
+		if (!SELFTEST_EXPECT(test, !IS_ERR(task)))
+			selftest_race_finish(&race);
+	}
+	selftest_race_finish(&race);
+
+	wait_for_completion(&race.done);
+
+	/* wait for the deferred fput()s of the proxies to settle */
+	for (i = 0; (kref_read(&fileref->refcount) != 1) && (i < 100); i++)
+		msleep(10);
+	SELFTEST_EXPECT(test, kref_read(&fileref->refcount) == 1);
+
+	/* only the entry and our own references may be left */
+	srvfs_fileref_set(fileref, NULL);
+	fput(race.be[0]->file);
+	fput(race.be[1]->file);
+	SELFTEST_EXPECT(test, selftest_backend_wait(race.be[0]));
+	SELFTEST_EXPECT(test, selftest_backend_wait(race.be[1]));
+	SELFTEST_EXPECT(test, atomic_read(&race.be[0]->released) == 1);
+	SELFTEST_EXPECT(test, atomic_read(&race.be[1]->released) == 1);
+}
+
+/* === runner === */
+
+#define SELFTEST_CASE(fn)	{ .name = #fn, .run = fn }
+
+static const struct {
+	const char *name;
+	void (*run)(struct selftest *test);
+} srvfs_selftests[] = {
+	SELFTEST_CASE(srvfs_test_fileref_get_put),
+	SELFTEST_CASE(srvfs_test_fileref_set),
+	SELFTEST_CASE(srvfs_test_fileref_shards),
+	SELFTEST_CASE(srvfs_test_fileref_eviction),
+	SELFTEST_CASE(srvfs_test_resolve),
+	SELFTEST_CASE(srvfs_test_proxy_fill_fops),
+	SELFTEST_CASE(srvfs_test_proxy_fops_reclaim),
+	SELFTEST_CASE(srvfs_test_bench_dispatch),
+	SELFTEST_CASE(srvfs_test_bench_fill_fops),
+	SELFTEST_CASE(srvfs_test_race),
+};
+
+/*
+ * Backends still holding references after a failed test are leaked on
+ * purpose, as their release would touch freed memory otherwise.
+ */
+static void selftest_free_backends(struct selftest *test)
+{
+	struct selftest_backend *be, *tmp;
+
+	list_for_each_entry_safe(be, tmp, &test->backends, list) {
+		if (atomic_read(&be->released) ||
+		    selftest_backend_wait(be))
+			kfree(be);
+		else
+			pr_err("%s: leaking unreleased backend\n", test->name);
+	}
+}
+
+struct selftest_runner {
+	struct completion done;
+	int failed;
+};
+
+static int selftest_run(void *data)
+{
+	struct selftest_runner *runner = data;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(srvfs_selftests); i++) {
+		struct selftest test = {
+			.name		= srvfs_selftests[i].name,
+			.backends	= LIST_HEAD_INIT(test.backends),
+		};
+
+		test.mnt = kern_mount(&srvfs_type);
+		if (IS_ERR(test.mnt)) {
+			pr_err("%s: mount failed: %ld\n", test.name,
+			       PTR_ERR(test.mnt));
+			runner->failed++;
+			continue;
+		}
+
+		srvfs_selftests[i].run(&test);
+
+		if (!IS_ERR(test.mnt))
+			kern_unmount(test.mnt);
+		selftest_free_backends(&test);
+
+		pr_info("%s: %s\n", test.name, test.failed ? "FAIL" : "ok");
+		if (test.failed)
+			runner->failed++;
+	}
+
+	pr_info("%d of %zu tests failed\n", runner->failed,
+		ARRAY_SIZE(srvfs_selftests));
+
+	/* the module might be gone right after completing */
+	complete_and_exit(&runner->done, 0);
+}
+
+/*
+ * The tests run in a kthread, where fput() is deferred to a workqueue,
+ * which the tests can wait for: in the insmod process it would be
+ * deferred until we're back in userland.
+ */
+int srvfs_selftest(void)
+{
+	struct selftest_runner runner = { .failed = 0 };
+	struct task_struct *task;
+
+	init_completion(&runner.done);
+
+	task = kthread_run(selftest_run, &runner, "srvfs-selftest");
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	wait_for_completion(&runner.done);
+
+	return runner.failed ? -EINVAL : 0;
+}
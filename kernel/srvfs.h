@@ -5,37 +5,157 @@
 
 #include <linux/fs.h>
 #include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <asm/atomic.h>
 
+#include "srvfs_uapi.h"
+
 #define SRVFS_MAGIC 0x29980123
 
 #define CONFIG_SRVFS_VFS_READWRITE
 
+/* max. number of srvfs files to walk through when resolving a post */
+#define SRVFS_MAX_HOPS 8
+
+struct srvfs_poll;
+
+/* one per backend wait queue we're registered on */
+struct srvfs_poll_entry {
+	struct list_head node;
+	struct srvfs_poll *poll;
+	wait_queue_head_t *whead;
+	wait_queue_t wait;
+};
+
+struct srvfs_poll {
+	struct mutex mutex;
+	wait_queue_head_t wq;		/* proxies' pollers wait here */
+	struct file *file;		/* backend we're registered on */
+	poll_table pt;
+	struct list_head entries;
+	bool failed;			/* couldn't register on all queues */
+};
+
+struct srvfs_sb;
+
+/* backends of a sharded entry, freed via RCU */
+struct srvfs_shards {
+	unsigned int flags;		/* SRVFS_POST_SHARD_* */
+	unsigned int nfiles;
+	struct srvfs_sb *sbpriv;	/* charged against, may be NULL */
+	size_t charged;
+	struct rcu_head rcu;
+	struct file *files[];
+};
+
+/*
+ * proxy fops, built for one kind of backend. Shared by the proxies using
+ * it and cached in the fileref until the shrinker drops it.
+ */
+struct srvfs_fops {
+	struct kref refcount;
+	struct rcu_head rcu;
+	const struct file_operations *backend;
+	struct file_operations f_ops;
+};
+
 struct srvfs_fileref {
+	struct srvfs_sb *sbpriv;	/* NULL if not backing an entry */
 	atomic_t counter;
 	int mode;
 	struct file *file;
+	struct srvfs_shards *shards;	/* NULL if not sharded */
 	struct kref refcount;
-	struct file_operations f_ops;
+	struct srvfs_fops *fops;	/* cached, freed via RCU */
+	struct list_head fops_node;	/* in sbpriv->fops_list while idle */
+	struct srvfs_poll poll;
+};
+
+/*
+ * private_data of an open proxy. Control files (entries without a
+ * backend) have the fileref itself.
+ */
+struct srvfs_proxy {
+	struct srvfs_fileref *fileref;
+	struct file *locked;		/* backend our locks live on, pinned */
+	struct file *lease_file;	/* private file on it, holds our leases */
+	struct fasync_struct *lease_fasync;	/* signalled on lease breaks */
+	bool flocked;			/* holds a flock() via backend's ->flock */
+};
+
+#define SRVFS_DEFAULT_FILE_MODE (S_IWUSR | S_IRUGO)
+
+struct srvfs_mount_opts {
+	unsigned int max_entries;	/* 0 = unlimited */
+	unsigned long max_mem;		/* bytes, 0 = unlimited */
+	umode_t file_mode;		/* permissions of new entries */
+	bool handoff;			/* first opener takes the posted file */
+	bool demo;			/* create the counter demo entries */
 };
 
 struct srvfs_sb {
 	atomic_t inode_counter;
+	atomic_t nr_entries;
+	atomic_long_t mem_used;
+	atomic_long_t nr_idle_fops;
+	spinlock_t fops_lock;
+	struct list_head fops_list;	/* filerefs with idle cached fops */
+	struct srvfs_mount_opts opts;
 };
 
+extern struct file_system_type srvfs_type;
 extern struct file_operations srvfs_file_ops;
 extern const struct inode_operations srvfs_rootdir_inode_operations;
 extern const struct file_operations proxy_file_ops;
 
-struct srvfs_fileref *srvfs_fileref_new(void);
+int srvfs_fileref_cache_init(void);
+void srvfs_fileref_cache_exit(void);
+
+struct srvfs_fileref *srvfs_fileref_new(struct srvfs_sb *sbpriv);
 struct srvfs_fileref *srvfs_fileref_get(struct srvfs_fileref* fileref);
 void srvfs_fileref_put(struct srvfs_fileref* fileref);
 void srvfs_fileref_set(struct srvfs_fileref* fileref, struct file* newfile);
+void srvfs_fileref_set_shards(struct srvfs_fileref *fileref,
+			      struct srvfs_shards *shards);
+struct file *srvfs_fileref_get_file(struct srvfs_fileref *fileref);
+struct file *srvfs_fileref_get_shard(struct srvfs_fileref *fileref);
+struct srvfs_fileref *srvfs_fileref_takeover(struct srvfs_fileref *fileref);
+bool srvfs_fileref_drop_fops(struct srvfs_fileref *fileref);
+long srvfs_sb_drop_fops(struct srvfs_sb *sbpriv, long nr);
+
+struct srvfs_shards *srvfs_shards_new(struct srvfs_sb *sbpriv,
+				      unsigned int nfiles, unsigned int flags);
+void srvfs_shards_put(struct srvfs_shards *shards);
 
 int srvfs_fill_super (struct super_block *sb, void *data, int silent);
 int srvfs_inode_id (struct super_block *sb);
+int srvfs_sb_claim_entry(struct super_block *sb);
+void srvfs_sb_release_entry(struct super_block *sb);
+int srvfs_sb_charge(struct srvfs_sb *sbpriv, size_t size);
+void srvfs_sb_uncharge(struct srvfs_sb *sbpriv, size_t size);
 int srvfs_insert_file (struct super_block *sb, struct dentry *dentry);
+struct file *srvfs_resolve_file(struct srvfs_fileref *fileref,
+				struct file *newfile);
+long srvfs_file_post_ioctl(struct file *file, void __user *arg);
+
+int srvfs_proxy_open(struct file *file, struct srvfs_fileref *fileref);
+int srvfs_proxy_fill_fops(struct file *file, struct srvfs_fileref *fileref);
+struct srvfs_fileref *srvfs_file_fileref(struct file *file);
+bool srvfs_fops_put(struct srvfs_fops *fops);
+
+void srvfs_poll_init(struct srvfs_poll *p);
+void srvfs_poll_repost(struct srvfs_fileref *fileref, struct file *oldfile);
+unsigned int srvfs_poll(struct srvfs_fileref *fileref, struct file *proxy,
+			struct file *target, poll_table *pt);
 
-void srvfs_proxy_fill_fops(struct file *file);
+#ifdef CONFIG_SRVFS_SELFTEST
+int srvfs_selftest(void);
+#else
+static inline int srvfs_selftest(void) { return 0; }
+#endif
 
 #endif /* __LINUX_FS_SRVFS_H */
@@ -6,6 +6,8 @@
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
@@ -22,27 +24,215 @@ static void srvfs_sb_evict_inode(struct inode *inode)
 
 	pr_info("srvfs_evict_inode(): %ld\n", inode->i_ino);
 	clear_inode(inode);
-	if (fileref)
+	if (fileref) {
 		srvfs_fileref_put(fileref);
-	else
+		srvfs_sb_release_entry(inode->i_sb);
+	} else
 		pr_info("evicting root/dir inode\n");
 }
 
+static void srvfs_sb_free(struct srvfs_sb *sbpriv)
+{
+	kfree(sbpriv);
+}
+
 static void srvfs_sb_put_super(struct super_block *sb)
 {
 	pr_info("srvfs: freeing superblock");
 	if (sb->s_fs_info) {
-		kfree(sb->s_fs_info);
+		srvfs_sb_free(sb->s_fs_info);
 		sb->s_fs_info = NULL;
 	}
 }
 
+/*
+ * Proxy fops tables cached in the entries can be rebuilt on next open, so
+ * let the superblock shrinker drop the ones no proxy uses under memory
+ * pressure. The posted files themselves are never touched. The shrinker may run on a
+ * superblock whose fill_super() failed, so s_fs_info can be NULL.
+ */
+static long srvfs_sb_nr_cached_objects(struct super_block *sb,
+				       struct shrink_control *sc)
+{
+	struct srvfs_sb *sbpriv = sb->s_fs_info;
+
+	if (!sbpriv)
+		return 0;
+	return atomic_long_read(&sbpriv->nr_idle_fops);
+}
+
+static long srvfs_sb_free_cached_objects(struct super_block *sb,
+					 struct shrink_control *sc)
+{
+	struct srvfs_sb *sbpriv = sb->s_fs_info;
+
+	if (!sbpriv)
+		return 0;
+	return srvfs_sb_drop_fops(sbpriv, sc->nr_to_scan);
+}
+
+static int srvfs_sb_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct srvfs_sb *sbpriv = root->d_sb->s_fs_info;
+	struct srvfs_mount_opts *opts = &sbpriv->opts;
+
+	if (opts->max_entries)
+		seq_printf(m, ",max_entries=%u", opts->max_entries);
+	if (opts->max_mem)
+		seq_printf(m, ",max_mem=%lu", opts->max_mem);
+	if (opts->file_mode != SRVFS_DEFAULT_FILE_MODE)
+		seq_printf(m, ",file_mode=%o", opts->file_mode);
+	if (opts->handoff)
+		seq_puts(m, ",handoff");
+	if (!opts->demo)
+		seq_puts(m, ",nodemo");
+	return 0;
+}
+
 static const struct super_operations srvfs_super_operations = {
 	.statfs		= simple_statfs,
 	.evict_inode	= srvfs_sb_evict_inode,
 	.put_super	= srvfs_sb_put_super,
+	.show_options	= srvfs_sb_show_options,
+	.nr_cached_objects	= srvfs_sb_nr_cached_objects,
+	.free_cached_objects	= srvfs_sb_free_cached_objects,
+};
+
+enum {
+	Opt_max_entries,
+	Opt_max_mem,
+	Opt_file_mode,
+	Opt_proxy,
+	Opt_handoff,
+	Opt_demo,
+	Opt_nodemo,
+	Opt_err,
 };
 
+static const match_table_t tokens = {
+	{Opt_max_entries,	"max_entries=%u"},
+	{Opt_max_mem,		"max_mem=%s"},
+	{Opt_file_mode,		"file_mode=%o"},
+	{Opt_proxy,		"proxy"},
+	{Opt_handoff,		"handoff"},
+	{Opt_demo,		"demo"},
+	{Opt_nodemo,		"nodemo"},
+	{Opt_err,		NULL},
+};
+
+static int srvfs_parse_options(char *data, struct srvfs_mount_opts *opts)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p, *rest;
+	int option;
+
+	opts->max_entries = 0;
+	opts->max_mem = 0;
+	opts->file_mode = SRVFS_DEFAULT_FILE_MODE;
+	opts->handoff = false;
+	opts->demo = true;
+
+	if (!data)
+		return 0;
+
+	while ((p = strsep(&data, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_max_entries:
+			if (match_int(&args[0], &option) || (option < 0))
+				goto bad;
+			opts->max_entries = option;
+			break;
+		case Opt_max_mem:
+			/* k, m, g suffixes as usual */
+			opts->max_mem = memparse(args[0].from, &rest);
+			if (*rest)
+				goto bad;
+			break;
+		case Opt_file_mode:
+			if (match_octal(&args[0], &option))
+				goto bad;
+			opts->file_mode = option & S_IALLUGO;
+			break;
+		case Opt_proxy:
+			opts->handoff = false;
+			break;
+		case Opt_handoff:
+			opts->handoff = true;
+			break;
+		case Opt_demo:
+			opts->demo = true;
+			break;
+		case Opt_nodemo:
+			opts->demo = false;
+			break;
+		default:
+			goto bad;
+		}
+	}
+
+	return 0;
+
+bad:
+	pr_err("srvfs: invalid mount option: %s\n", p);
+	return -EINVAL;
+}
+
+/* account memory against the max_mem budget, sbpriv may be NULL */
+int srvfs_sb_charge(struct srvfs_sb *sbpriv, size_t size)
+{
+	if (!sbpriv)
+		return 0;
+
+	if ((atomic_long_add_return(size, &sbpriv->mem_used) >
+	     sbpriv->opts.max_mem) && sbpriv->opts.max_mem) {
+		atomic_long_sub(size, &sbpriv->mem_used);
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+void srvfs_sb_uncharge(struct srvfs_sb *sbpriv, size_t size)
+{
+	if (sbpriv)
+		atomic_long_sub(size, &sbpriv->mem_used);
+}
+
+/* roughly what an entry pins, besides the posted file */
+#define SRVFS_ENTRY_COST \
+	(sizeof(struct srvfs_fileref) + sizeof(struct inode) + \
+	 sizeof(struct dentry))
+
+/* account a new entry against the max_entries and max_mem limits */
+int srvfs_sb_claim_entry(struct super_block *sb)
+{
+	struct srvfs_sb *sbpriv = sb->s_fs_info;
+	unsigned int max = sbpriv->opts.max_entries;
+	int ret;
+
+	if (!max)
+		atomic_inc(&sbpriv->nr_entries);
+	else if (!atomic_add_unless(&sbpriv->nr_entries, 1, max))
+		return -ENOSPC;
+
+	ret = srvfs_sb_charge(sbpriv, SRVFS_ENTRY_COST);
+	if (ret)
+		atomic_dec(&sbpriv->nr_entries);
+
+	return ret;
+}
+
+void srvfs_sb_release_entry(struct super_block *sb)
+{
+	struct srvfs_sb *sbpriv = sb->s_fs_info;
+
+	srvfs_sb_uncharge(sbpriv, SRVFS_ENTRY_COST);
+	atomic_dec(&sbpriv->nr_entries);
+}
+
 int srvfs_inode_id (struct super_block *sb)
 {
 	struct srvfs_sb *priv = sb->s_fs_info;
@@ -66,13 +256,20 @@ int srvfs_fill_super (struct super_block *sb, void *data, int silent)
 	struct dentry *root;
 	int i;
 	struct srvfs_sb* sbpriv;
-	int ret = 0;
+	int ret = -ENOMEM;
 
-	sbpriv = kmalloc(sizeof(struct srvfs_sb), GFP_KERNEL);
+	sbpriv = kzalloc(sizeof(struct srvfs_sb), GFP_KERNEL_ACCOUNT);
 	if (sbpriv == NULL)
 		goto err_sbpriv;
 
+	ret = srvfs_parse_options(data, &sbpriv->opts);
+	if (ret)
+		goto err_opts;
+	ret = -ENOMEM;
+
 	atomic_set(&sbpriv->inode_counter, 1);
+	spin_lock_init(&sbpriv->fops_lock);
+	INIT_LIST_HEAD(&sbpriv->fops_list);
 
 	sb->s_blocksize = PAGE_SIZE;
 	sb->s_blocksize_bits = PAGE_SHIFT;
@@ -98,30 +295,28 @@ int srvfs_fill_super (struct super_block *sb, void *data, int silent)
 	root = d_make_root(inode);
 	if (!root) {
 		pr_info("fill_super(): could not create root\n");
-		goto err_root;
+		goto err_inode;
 	}
 	sb->s_root = root;
 
+	if (!sbpriv->opts.demo)
+		return 0;
+
 	for (i = 0; i<ARRAY_SIZE(names); i++) {
 		ret = srvfs_create_file(sb, root, names[i]);
 		if (ret) {
+			/* kill_sb() cleans up the root and its entries */
 			pr_err("srvfs_create_file() returned: %d\n", ret);
-			goto out;
+			return ret;
 		}
 	}
 	return 0;
-out:
-	d_genocide(root);
-	shrink_dcache_parent(root);
-	dput(root);
-	goto err_inode;
-
-err_root:
-	iput(inode);
 
 err_inode:
-	kfree(sbpriv);
+	sb->s_fs_info = NULL;
+err_opts:
+	srvfs_sb_free(sbpriv);
 
 err_sbpriv:
-	return -ENOMEM;
+	return ret;
 }
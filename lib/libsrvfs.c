@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+
+#include "srvfs_uapi.h"
+#include "libsrvfs.h"
+
+struct srvfs {
+	int dirfd;
+};
+
+struct srvfs *srvfs_open(const char* mountpoint)
+{
+	struct srvfs *srv = calloc(1, sizeof(struct srvfs));
+
+	if (!srv)
+		return NULL;
+
+	srv->dirfd = open(mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (srv->dirfd == -1) {
+		int err = errno;
+		free(srv);
+		errno = err;
+		return NULL;
+	}
+
+	return srv;
+}
+
+void srvfs_close(struct srvfs *srv)
+{
+	if (!srv)
+		return;
+
+	close(srv->dirfd);
+	free(srv);
+}
+
+int srvfs_dirfd(struct srvfs *srv)
+{
+	return srv->dirfd;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret = write(fd, buf, len);
+
+	if (ret == -1)
+		return -1;
+
+	/* the kernel consumes a post record at once, or not at all */
+	if ((size_t)ret != len) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int post_legacy(int ctrl_fd, int fd)
+{
+	char buffer[16];
+	int len = snprintf(buffer, sizeof(buffer), "%d", fd);
+
+	return write_all(ctrl_fd, buffer, len);
+}
+
+static int post_record(int ctrl_fd, const int *fds, unsigned int nfds,
+		       unsigned int post_flags)
+{
+	size_t len = SRVFS_POST_SIZE(nfds);
+	struct srvfs_post *post;
+	unsigned int i;
+	int ret, err;
+
+	post = calloc(1, len);
+	if (!post)
+		return -1;
+
+	post->magic = SRVFS_POST_MAGIC;
+	post->version = SRVFS_POST_VERSION;
+	post->flags = post_flags;
+	post->nfds = nfds;
+	for (i = 0; i < nfds; i++)
+		post->fds[i] = fds[i];
+
+	ret = write_all(ctrl_fd, post, len);
+	err = errno;
+	free(post);
+	errno = err;
+
+	return ret;
+}
+
+static int post_binary(int ctrl_fd, int fd)
+{
+	if (post_record(ctrl_fd, &fd, 1, 0) == 0)
+		return 0;
+
+	/* older kernels don't know the binary format yet */
+	if (errno == EINVAL)
+		return post_legacy(ctrl_fd, fd);
+
+	return -1;
+}
+
+static int do_post(int ctrl_fd, int fd, int flags)
+{
+	if (flags & SRVFS_LEGACY)
+		return post_legacy(ctrl_fd, fd);
+
+	return post_binary(ctrl_fd, fd);
+}
+
+static int create_entry(struct srvfs *srv, const char* name, int flags)
+{
+	if ((flags & SRVFS_REPLACE) &&
+	    (unlinkat(srv->dirfd, name, 0) == -1) && (errno != ENOENT))
+		return -1;
+
+	return openat(srv->dirfd, name,
+		      O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+}
+
+/* don't leave an empty entry behind */
+static int abort_entry(struct srvfs *srv, const char* name, int ctrl_fd)
+{
+	int err = errno;
+
+	close(ctrl_fd);
+	unlinkat(srv->dirfd, name, 0);
+	errno = err;
+	return -1;
+}
+
+int srvfs_post(struct srvfs *srv, const char* name, int fd, int flags)
+{
+	int ctrl_fd = create_entry(srv, name, flags);
+
+	if (ctrl_fd == -1)
+		return -1;
+
+	if (do_post(ctrl_fd, fd, flags) == -1)
+		return abort_entry(srv, name, ctrl_fd);
+
+	return close(ctrl_fd);
+}
+
+int srvfs_post_sharded(struct srvfs *srv, const char* name, const int *fds,
+		       unsigned int nfds, int flags)
+{
+	unsigned int post_flags = (flags & SRVFS_SHARD_NODE) ?
+		SRVFS_POST_SHARD_NODE : SRVFS_POST_SHARD_CPU;
+	int ctrl_fd;
+
+	if (!nfds || (nfds > SRVFS_POST_MAX_FDS)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctrl_fd = create_entry(srv, name, flags);
+	if (ctrl_fd == -1)
+		return -1;
+
+	if (post_record(ctrl_fd, fds, nfds, post_flags) == -1)
+		return abort_entry(srv, name, ctrl_fd);
+
+	return close(ctrl_fd);
+}
+
+int srvfs_repost(struct srvfs *srv, const char* name, int fd)
+{
+	char buffer[SRVFS_POST_SIZE(1)];
+	struct srvfs_post *post = (struct srvfs_post *)buffer;
+	int entry_fd, ret, err;
+
+	/*
+	 * If the entry already has a file posted, we get a proxy here and
+	 * write() would go to that file, so the record goes via ioctl().
+	 */
+	entry_fd = openat(srv->dirfd, name, O_WRONLY | O_CLOEXEC);
+	if (entry_fd == -1)
+		return -1;
+
+	memset(buffer, 0, sizeof(buffer));
+	post->magic = SRVFS_POST_MAGIC;
+	post->version = SRVFS_POST_VERSION;
+	post->nfds = 1;
+	post->fds[0] = fd;
+
+	ret = ioctl(entry_fd, SRVFS_IOC_POST, post);
+	err = errno;
+	close(entry_fd);
+	errno = err;
+
+	return (ret == -1) ? -1 : 0;
+}
+
+int srvfs_post_batch(struct srvfs *srv, struct srvfs_post_entry *ents,
+		     size_t count, int flags)
+{
+	size_t i;
+	int posted = 0;
+
+	for (i = 0; i < count; i++) {
+		if (srvfs_post(srv, ents[i].name, ents[i].fd, flags) == -1) {
+			ents[i].error = errno;
+		} else {
+			ents[i].error = 0;
+			posted++;
+		}
+	}
+
+	return posted;
+}
+
+int srvfs_retrieve(struct srvfs *srv, const char* name, int oflags)
+{
+	return openat(srv->dirfd, name, oflags | O_CLOEXEC);
+}
+
+int srvfs_remove(struct srvfs *srv, const char* name)
+{
+	return unlinkat(srv->dirfd, name, 0);
+}
+
+int srvfs_list(struct srvfs *srv, srvfs_list_cb cb, void *arg)
+{
+	struct dirent *de;
+	DIR *dir;
+	int fd, ret = 0;
+
+	/* closedir() closes the fd, so we need our own one */
+	fd = openat(srv->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	/* readdir() only sets errno on failure, the callback may leave it */
+	for (;;) {
+		errno = 0;
+		de = readdir(dir);
+		if (!de)
+			break;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		ret = cb(de->d_name, arg);
+		if (ret)
+			break;
+	}
+
+	if (!de && errno) {
+		int err = errno;
+		closedir(dir);
+		errno = err;
+		return -1;
+	}
+
+	closedir(dir);
+	return ret;
+}
@@ -0,0 +1,62 @@
+#ifndef __LIBSRVFS_H
+#define __LIBSRVFS_H
+
+/*
+ * libsrvfs - client library for posting and retrieving file descriptors
+ * via srvfs.
+ *
+ * All functions returning int return -1 on failure and set errno.
+ */
+
+#include <stddef.h>
+
+struct srvfs;
+
+/* flags for srvfs_post() */
+#define SRVFS_REPLACE	0x1	/* replace an already existing entry */
+#define SRVFS_LEGACY	0x2	/* use the legacy ascii post format */
+#define SRVFS_SHARD_NODE 0x4	/* shard writes by NUMA node instead of CPU */
+
+struct srvfs_post_entry {
+	const char *name;
+	int fd;
+	int error;		/* errno of this entry, 0 on success */
+};
+
+typedef int (*srvfs_list_cb)(const char* name, void *arg);
+
+/* open an srvfs mount, all further calls go relative to its dirfd */
+struct srvfs *srvfs_open(const char* mountpoint);
+void srvfs_close(struct srvfs *srv);
+int srvfs_dirfd(struct srvfs *srv);
+
+/* create a new entry and post fd into it */
+int srvfs_post(struct srvfs *srv, const char* name, int fd, int flags);
+
+/*
+ * create a new sharded entry, writes on it go to one of fds, picked by the
+ * writer's CPU (or NUMA node with SRVFS_SHARD_NODE)
+ */
+int srvfs_post_sharded(struct srvfs *srv, const char* name, const int *fds,
+		       unsigned int nfds, int flags);
+
+/* post fd into an already existing entry, fd -1 just detaches */
+int srvfs_repost(struct srvfs *srv, const char* name, int fd);
+
+/* post a bunch of entries, returns the number of successful posts */
+int srvfs_post_batch(struct srvfs *srv, struct srvfs_post_entry *ents,
+		     size_t count, int flags);
+
+/* open a posted entry, returns the new fd */
+int srvfs_retrieve(struct srvfs *srv, const char* name, int oflags);
+
+/* remove an entry, dropping the posted fd */
+int srvfs_remove(struct srvfs *srv, const char* name);
+
+/*
+ * call cb for each entry, stops when cb returns nonzero and returns that
+ * value, otherwise 0.
+ */
+int srvfs_list(struct srvfs *srv, srvfs_list_cb cb, void *arg);
+
+#endif /* __LIBSRVFS_H */
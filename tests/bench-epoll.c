@@ -0,0 +1,276 @@
+/*
+ * bench-epoll: epoll wakeup latency over many posted sockets
+ *
+ * Posts lots of socketpair ends into srvfs and waits on all of them
+ * (either directly or via their srvfs proxies) with epoll, while the main
+ * thread pokes random sockets, one at a time, and measures how long it
+ * takes until a waiter sees the event.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "libsrvfs.h"
+#include "common.h"
+#include "bench.h"
+
+#define WAKEUP_DELAY_US	20
+#define MAX_EVENTS	64
+
+static int nsockets = 10000;
+static int iterations = 10000;
+static int nwaiters = 1;
+static int edge_triggered;
+static int exclusive;
+
+static struct srvfs *srv;
+static int *sock_fds, *peer_fds, *proxy_fds;
+static volatile uint64_t *stamps;
+static volatile int stop;
+static int ack[2];
+
+struct waiter {
+	pthread_t thread;
+	int epfd;
+	const int *fds;
+	uint64_t *lat;
+	unsigned long nlat;
+};
+
+static void *waiter_main(void *arg)
+{
+	struct waiter *w = arg;
+	struct epoll_event evs[MAX_EVENTS];
+	char c;
+	int i, n;
+
+	while (!stop) {
+		n = epoll_wait(w->epfd, evs, MAX_EVENTS, 100);
+		if ((n == -1) && (errno != EINTR))
+			fail("epoll_wait");
+
+		for (i = 0; i < n; i++) {
+			uint64_t now = bench_now_ns();
+			int idx = evs[i].data.u32;
+
+			/* another exclusive waiter might have been faster */
+			if (read(w->fds[idx], &c, 1) != 1)
+				continue;
+
+			if (w->nlat < (unsigned long)iterations)
+				w->lat[w->nlat++] = now - stamps[idx];
+
+			if (write(ack[1], &c, 1) != 1)
+				fail("writing ack");
+		}
+	}
+	return NULL;
+}
+
+static void run(const char* mode, const int *fds)
+{
+	struct waiter waiters[nwaiters];
+	struct bench_result res = {
+		.test		= "epoll-wakeup",
+		.backend	= "socket",
+		.mode		= mode,
+		.threads	= nwaiters,
+	};
+	char extra[128];
+	uint64_t start;
+	int i, j;
+	char c = 0;
+
+	snprintf(extra, sizeof(extra), "fds=%d edge=%d exclusive=%d",
+		 nsockets, edge_triggered, exclusive);
+	res.extra = extra;
+
+	res.lat = calloc((size_t)nwaiters * iterations, sizeof(uint64_t));
+	if (!res.lat)
+		fail("allocating latency buffer");
+
+	stop = 0;
+	for (i = 0; i < nwaiters; i++) {
+		struct waiter *w = &waiters[i];
+
+		memset(w, 0, sizeof(*w));
+		w->fds = fds;
+		w->lat = res.lat + (size_t)i * iterations;
+		w->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (w->epfd == -1)
+			fail("creating epoll fd");
+
+		for (j = 0; j < nsockets; j++) {
+			struct epoll_event ev = {
+				.events = EPOLLIN |
+					(edge_triggered ? EPOLLET : 0) |
+					(exclusive ? EPOLLEXCLUSIVE : 0),
+				.data.u32 = j,
+			};
+
+			if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fds[j], &ev))
+				fail("adding fd to epoll");
+		}
+
+		if (pthread_create(&w->thread, NULL, waiter_main, w))
+			fail("creating waiter");
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < iterations; i++) {
+		int idx = rand() % nsockets;
+
+		/* give the waiters a chance to actually go to sleep */
+		usleep(WAKEUP_DELAY_US);
+		stamps[idx] = bench_now_ns();
+		if (write(peer_fds[idx], &c, 1) != 1)
+			fail("poking socket");
+		if (read(ack[0], &c, 1) != 1)
+			fail("reading ack");
+	}
+	res.ns = bench_now_ns() - start;
+
+	stop = 1;
+	for (i = 0; i < nwaiters; i++) {
+		struct waiter *w = &waiters[i];
+
+		pthread_join(w->thread, NULL);
+		close(w->epfd);
+
+		memmove(res.lat + res.nlat, w->lat, w->nlat * sizeof(uint64_t));
+		res.nlat += w->nlat;
+	}
+	res.ops = res.nlat;
+
+	bench_print(&res);
+	free(res.lat);
+}
+
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		fail("getting fd limit");
+
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl))
+		fail("raising fd limit");
+
+	if (rl.rlim_cur < (rlim_t)nsockets * 3 + 64)
+		fail("fd limit too low for that many sockets");
+}
+
+static void setup_sockets(void)
+{
+	struct srvfs_post_entry *ents;
+	char name[64];
+	int i, sv[2];
+
+	sock_fds = calloc(nsockets, sizeof(int));
+	peer_fds = calloc(nsockets, sizeof(int));
+	proxy_fds = calloc(nsockets, sizeof(int));
+	stamps = calloc(nsockets, sizeof(uint64_t));
+	ents = calloc(nsockets, sizeof(*ents));
+	if (!sock_fds || !peer_fds || !proxy_fds || !stamps || !ents)
+		fail("allocating socket tables");
+
+	for (i = 0; i < nsockets; i++) {
+		/* proxies use the backend's flags, so make it nonblocking */
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+			       SOCK_CLOEXEC, 0, sv))
+			fail("creating socketpair");
+
+		sock_fds[i] = sv[0];
+		peer_fds[i] = sv[1];
+
+		snprintf(name, sizeof(name), "epoll-%d-%d", getpid(), i);
+		ents[i].name = strdup(name);
+		ents[i].fd = sv[0];
+		if (!ents[i].name)
+			fail("allocating names");
+	}
+
+	if (srvfs_post_batch(srv, ents, nsockets, SRVFS_REPLACE) != nsockets)
+		fail("posting sockets");
+
+	for (i = 0; i < nsockets; i++) {
+		proxy_fds[i] = srvfs_retrieve(srv, ents[i].name, O_RDWR);
+		if (proxy_fds[i] == -1)
+			fail("retrieving socket");
+
+		/* the open proxy keeps it alive */
+		srvfs_remove(srv, ents[i].name);
+		free((char *)ents[i].name);
+	}
+
+	free(ents);
+}
+
+static void usage(void)
+{
+	fail("parameters: [-n sockets] [-i iterations] [-t waiters] [-e] [-x] "
+	     "<srvfs>");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:i:t:ex")) != -1) {
+		switch (opt) {
+		case 'n':
+			nsockets = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			nwaiters = atoi(optarg);
+			break;
+		case 'e':
+			edge_triggered = 1;
+			break;
+		case 'x':
+			exclusive = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind >= argc) || (nsockets < 1) || (iterations < 1) ||
+	    (nwaiters < 1))
+		usage();
+
+	/* several non-exclusive waiters would all race for each event */
+	if ((nwaiters > 1) && !exclusive)
+		fail("multiple waiters need -x");
+
+	raise_fd_limit();
+
+	srv = srvfs_open(argv[optind]);
+	if (!srv)
+		fail("opening srvfs");
+
+	if (pipe(ack) == -1)
+		fail("creating ack pipe");
+
+	setup_sockets();
+
+	run("direct", sock_fds);
+	run("srvfs", proxy_fds);
+
+	srvfs_close(srv);
+	return 0;
+}
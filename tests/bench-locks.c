@@ -0,0 +1,183 @@
+/*
+ * bench-locks: fcntl lock contention through srvfs proxies
+ *
+ * Threads take and release OFD write locks on one regular file, each
+ * through its own open file description: either opened directly, or
+ * retrieved from an srvfs entry the file is posted to. All threads lock
+ * the same range (contended) or one byte each (disjoint), the latter
+ * still contending on the inode's lock list.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libsrvfs.h"
+#include "common.h"
+#include "bench.h"
+
+static int max_threads = 4;
+static int iterations = 100000;
+static int disjoint;
+
+static struct srvfs *srv;
+static char entry_name[64];
+static char localname[256];
+
+struct locker {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	int fd;
+	off_t start;
+	uint64_t *lat;
+};
+
+static void setlk(int fd, short type, off_t start, int cmd)
+{
+	struct flock fl = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+		.l_start = start,
+		.l_len = 1,
+	};
+
+	if (fcntl(fd, cmd, &fl))
+		fail("fcntl lock");
+}
+
+static void *locker_main(void *arg)
+{
+	struct locker *l = arg;
+	uint64_t start;
+	int i;
+
+	pthread_barrier_wait(l->barrier);
+	for (i = 0; i < iterations; i++) {
+		start = bench_now_ns();
+		setlk(l->fd, F_WRLCK, l->start, F_OFD_SETLKW);
+		setlk(l->fd, F_UNLCK, l->start, F_OFD_SETLK);
+		l->lat[i] = bench_now_ns() - start;
+	}
+
+	return NULL;
+}
+
+/*
+ * mode "direct": each thread opens the file itself
+ * mode "srvfs": each thread retrieves its own proxy
+ */
+static void run(const char* mode, int nthreads)
+{
+	struct locker lockers[nthreads];
+	pthread_barrier_t barrier;
+	struct bench_result res = {
+		.test		= "fcntl-lock",
+		.backend	= "file",
+		.mode		= mode,
+		.threads	= nthreads,
+		.extra		= disjoint ? "range=disjoint" : "range=shared",
+	};
+	uint64_t start;
+	int i;
+
+	res.nlat = (unsigned long)nthreads * iterations;
+	res.lat = calloc(res.nlat, sizeof(uint64_t));
+	if (!res.lat)
+		fail("allocating latency buffer");
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		struct locker *l = &lockers[i];
+
+		l->barrier = &barrier;
+		l->start = disjoint ? i : 0;
+		l->lat = res.lat + (size_t)i * iterations;
+		if (strcmp(mode, "direct"))
+			l->fd = srvfs_retrieve(srv, entry_name, O_RDWR);
+		else
+			l->fd = open(localname, O_RDWR);
+		if (l->fd == -1)
+			fail("opening file");
+
+		if (pthread_create(&l->thread, NULL, locker_main, l))
+			fail("creating locker");
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = bench_now_ns();
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(lockers[i].thread, NULL);
+	res.ns = bench_now_ns() - start;
+	res.ops = res.nlat;
+
+	bench_print(&res);
+
+	for (i = 0; i < nthreads; i++)
+		close(lockers[i].fd);
+	pthread_barrier_destroy(&barrier);
+	free(res.lat);
+}
+
+static void usage(void)
+{
+	fail("parameters: [-t max_threads] [-i iterations] [-r] [-d tmpdir] "
+	     "<srvfs>");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *tmpdir = "/tmp";
+	int opt, n, fd;
+
+	while ((opt = getopt(argc, argv, "t:i:rd:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'r':
+			disjoint = 1;
+			break;
+		case 'd':
+			tmpdir = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind >= argc) || (max_threads < 1) || (iterations < 1))
+		usage();
+
+	srv = srvfs_open(argv[optind]);
+	if (!srv)
+		fail("opening srvfs");
+
+	snprintf(entry_name, sizeof(entry_name), "locks-%d", getpid());
+	snprintf(localname, sizeof(localname), "%s/srvfs-bench-locks-%d",
+		 tmpdir, getpid());
+
+	fd = open_localfile(localname);
+	if (srvfs_post(srv, entry_name, fd, SRVFS_REPLACE))
+		fail("posting file");
+	close(fd);
+
+	for (n = 1; n <= max_threads; n++) {
+		run("direct", n);
+		run("srvfs", n);
+	}
+
+	srvfs_remove(srv, entry_name);
+	unlink(localname);
+	srvfs_close(srv);
+	return 0;
+}
@@ -0,0 +1,705 @@
+/*
+ * bench-proxy: compare direct fds against srvfs proxied fds
+ *
+ * Every test runs against each backend type (pipe, socket, regular file),
+ * once on the backend fds directly and once on fds retrieved via srvfs,
+ * at 1..N threads. Each thread gets its own backend instance, so the
+ * numbers show the proxy overhead and how it scales, not contention on a
+ * single backend.
+ *
+ * Results are printed as key=value lines (see bench.h).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "libsrvfs.h"
+#include "common.h"
+#include "bench.h"
+
+#define BE_PIPE		0x1
+#define BE_SOCKET	0x2
+#define BE_FILE		0x4
+#define BE_STREAM	(BE_PIPE | BE_SOCKET)
+#define BE_ALL		(BE_PIPE | BE_SOCKET | BE_FILE)
+
+#define SEQ_CHUNK	(64 * 1024)
+#define FILE_SIZE	(64 * 1024 * 1024)
+#define MMAP_SIZE	(1024 * 1024)
+#define WAKEUP_DELAY_US	20
+
+static int max_threads = 4;
+static int iterations = 10000;
+static size_t iosize = 64;
+static unsigned int backends = BE_ALL;
+static const char *only_test;
+static const char *tmpdir = "/tmp";
+static struct srvfs *srv;
+static long page_size;
+
+/* one backend instance, owned by one worker thread */
+struct endpoint {
+	int type;
+	int wr, rd;			/* backend fds under test */
+	int peer_rd, peer_wr;		/* other end of wr / rd */
+	int proxy_wr, proxy_rd;		/* wr / rd retrieved via srvfs */
+	char wr_name[64], rd_name[64];	/* srvfs entries */
+	char path[PATH_MAX];		/* regular file backend */
+	int src_fd;			/* sendfile source */
+	int null_fd;			/* sendfile sink */
+};
+
+struct worker {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	struct endpoint *ep;
+	const struct bench_test *test;
+	int proxied;
+	int wr, rd;
+	uint64_t *lat;
+	unsigned long nlat;
+	unsigned long ops;
+	uint64_t bytes;
+	char *buf;
+};
+
+struct bench_test {
+	const char *name;
+	unsigned int backends;
+	int direct_file_only;		/* direct mode needs a path to open */
+	void (*run)(struct worker *w);
+};
+
+static void xwrite(int fd, const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret <= 0)
+			fail("writing");
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+}
+
+static void xread(int fd, void *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = read(fd, buf, len);
+		if (ret <= 0)
+			fail("reading");
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+}
+
+static void xlseek(int fd, off_t off)
+{
+	if (lseek(fd, off, SEEK_SET) == -1)
+		fail("seeking");
+}
+
+static void add_lat(struct worker *w, uint64_t ns)
+{
+	w->lat[w->nlat++] = ns;
+}
+
+/* === tests === */
+
+static void run_lat_write(struct worker *w)
+{
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		if (w->ep->type == BE_FILE)
+			xlseek(w->wr, 0);
+
+		start = bench_now_ns();
+		xwrite(w->wr, w->buf, iosize);
+		add_lat(w, bench_now_ns() - start);
+
+		if (w->ep->type != BE_FILE)
+			xread(w->ep->peer_rd, w->buf, iosize);
+	}
+	w->ops = iterations;
+	w->bytes = (uint64_t)iterations * iosize;
+}
+
+static void run_lat_read(struct worker *w)
+{
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		if (w->ep->type == BE_FILE)
+			xlseek(w->rd, 0);
+		else
+			xwrite(w->ep->peer_wr, w->buf, iosize);
+
+		start = bench_now_ns();
+		xread(w->rd, w->buf, iosize);
+		add_lat(w, bench_now_ns() - start);
+	}
+	w->ops = iterations;
+	w->bytes = (uint64_t)iterations * iosize;
+}
+
+static int seq_ops(void)
+{
+	return iterations / 10 ? iterations / 10 : 1;
+}
+
+static void run_seq_write(struct worker *w)
+{
+	off_t pos = 0;
+	int i, n = seq_ops();
+
+	if (w->ep->type == BE_FILE)
+		xlseek(w->wr, 0);
+
+	for (i = 0; i < n; i++) {
+		if (w->ep->type == BE_FILE) {
+			if (pos >= FILE_SIZE) {
+				xlseek(w->wr, 0);
+				pos = 0;
+			}
+			pos += SEQ_CHUNK;
+		}
+
+		xwrite(w->wr, w->buf, SEQ_CHUNK);
+
+		if (w->ep->type != BE_FILE)
+			xread(w->ep->peer_rd, w->buf, SEQ_CHUNK);
+	}
+	w->ops = n;
+	w->bytes = (uint64_t)n * SEQ_CHUNK;
+}
+
+static void run_seq_read(struct worker *w)
+{
+	off_t pos = 0;
+	int i, n = seq_ops();
+
+	if (w->ep->type == BE_FILE)
+		xlseek(w->rd, 0);
+
+	for (i = 0; i < n; i++) {
+		if (w->ep->type == BE_FILE) {
+			if (pos >= FILE_SIZE) {
+				xlseek(w->rd, 0);
+				pos = 0;
+			}
+			pos += SEQ_CHUNK;
+		} else {
+			xwrite(w->ep->peer_wr, w->buf, SEQ_CHUNK);
+		}
+
+		xread(w->rd, w->buf, SEQ_CHUNK);
+	}
+	w->ops = n;
+	w->bytes = (uint64_t)n * SEQ_CHUNK;
+}
+
+static off_t random_offset(unsigned int *seed)
+{
+	return ((off_t)rand_r(seed) % (FILE_SIZE / page_size)) * page_size;
+}
+
+static void run_pwrite(struct worker *w)
+{
+	unsigned int seed = (unsigned int)(uintptr_t)w;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		off_t off = random_offset(&seed);
+
+		start = bench_now_ns();
+		if (pwrite(w->wr, w->buf, iosize, off) != (ssize_t)iosize)
+			fail("pwrite");
+		add_lat(w, bench_now_ns() - start);
+	}
+	w->ops = iterations;
+	w->bytes = (uint64_t)iterations * iosize;
+}
+
+static void run_pread(struct worker *w)
+{
+	unsigned int seed = (unsigned int)(uintptr_t)w;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		off_t off = random_offset(&seed);
+
+		start = bench_now_ns();
+		if (pread(w->rd, w->buf, iosize, off) != (ssize_t)iosize)
+			fail("pread");
+		add_lat(w, bench_now_ns() - start);
+	}
+	w->ops = iterations;
+	w->bytes = (uint64_t)iterations * iosize;
+}
+
+/*
+ * streams: sendfile() from a regular file into the (proxied) backend,
+ * files: sendfile() from the (proxied) backend into /dev/null
+ */
+static void run_sendfile(struct worker *w)
+{
+	uint64_t start;
+	off_t off;
+	ssize_t ret;
+	int i, n = seq_ops();
+
+	for (i = 0; i < n; i++) {
+		off = (w->ep->type == BE_FILE) ?
+			((off_t)i * SEQ_CHUNK) % FILE_SIZE : 0;
+
+		start = bench_now_ns();
+		if (w->ep->type == BE_FILE)
+			ret = sendfile(w->ep->null_fd, w->rd, &off, SEQ_CHUNK);
+		else
+			ret = sendfile(w->wr, w->ep->src_fd, &off, SEQ_CHUNK);
+		add_lat(w, bench_now_ns() - start);
+
+		if (ret != SEQ_CHUNK)
+			fail("sendfile");
+
+		if (w->ep->type != BE_FILE)
+			xread(w->ep->peer_rd, w->buf, SEQ_CHUNK);
+	}
+	w->ops = n;
+	w->bytes = (uint64_t)n * SEQ_CHUNK;
+}
+
+static void run_mmap_fault(struct worker *w)
+{
+	volatile char *map;
+	long pages = MMAP_SIZE / page_size;
+	int i, n = seq_ops();
+	long p;
+
+	for (i = 0; i < n; i++) {
+		map = mmap(NULL, MMAP_SIZE, PROT_READ, MAP_SHARED, w->rd,
+			   ((off_t)i * MMAP_SIZE) % FILE_SIZE);
+		if (map == MAP_FAILED)
+			fail("mmap");
+
+		for (p = 0; p < pages; p++)
+			(void)map[p * page_size];
+
+		munmap((void *)map, MMAP_SIZE);
+	}
+	w->ops = (unsigned long)n * pages;
+}
+
+/* === poll / epoll wakeup latency === */
+
+struct wakeup {
+	struct worker *w;
+	int ack[2];
+	volatile uint64_t stamp;
+};
+
+static void *wakeup_helper(void *arg)
+{
+	struct wakeup *wu = arg;
+	char c = 0;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		/* give the waiter a chance to actually go to sleep */
+		usleep(WAKEUP_DELAY_US);
+		wu->stamp = bench_now_ns();
+		xwrite(wu->w->ep->peer_wr, &c, 1);
+		xread(wu->ack[0], &c, 1);
+	}
+	return NULL;
+}
+
+static void run_wakeup(struct worker *w, int use_epoll)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct pollfd pfd = { .fd = w->rd, .events = POLLIN };
+	struct wakeup wu = { .w = w };
+	pthread_t helper;
+	int i, epfd = -1, ret;
+	char c;
+
+	if (pipe(wu.ack) == -1)
+		fail("creating ack pipe");
+
+	if (use_epoll) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if ((epfd == -1) || epoll_ctl(epfd, EPOLL_CTL_ADD, w->rd, &ev))
+			fail("setting up epoll");
+	}
+
+	if (pthread_create(&helper, NULL, wakeup_helper, &wu))
+		fail("creating wakeup helper");
+
+	for (i = 0; i < iterations; i++) {
+		if (use_epoll)
+			ret = epoll_wait(epfd, &ev, 1, -1);
+		else
+			ret = poll(&pfd, 1, -1);
+
+		if (ret != 1)
+			fail("waiting for wakeup");
+
+		add_lat(w, bench_now_ns() - wu.stamp);
+		xread(w->rd, &c, 1);
+		xwrite(wu.ack[1], &c, 1);
+	}
+
+	pthread_join(helper, NULL);
+	if (epfd != -1)
+		close(epfd);
+	close(wu.ack[0]);
+	close(wu.ack[1]);
+	w->ops = iterations;
+}
+
+static void run_poll_wakeup(struct worker *w)
+{
+	run_wakeup(w, 0);
+}
+
+static void run_epoll_wakeup(struct worker *w)
+{
+	run_wakeup(w, 1);
+}
+
+static void run_open_close(struct worker *w)
+{
+	int i, fd;
+
+	for (i = 0; i < iterations; i++) {
+		if (w->proxied)
+			fd = srvfs_retrieve(srv, w->ep->rd_name, O_RDONLY);
+		else
+			fd = open(w->ep->path, O_RDONLY | O_CLOEXEC);
+
+		if (fd == -1)
+			fail("opening");
+		close(fd);
+	}
+	w->ops = iterations;
+}
+
+static const struct bench_test tests[] = {
+	{ "lat-write",		BE_ALL,		0, run_lat_write },
+	{ "lat-read",		BE_ALL,		0, run_lat_read },
+	{ "seq-write",		BE_ALL,		0, run_seq_write },
+	{ "seq-read",		BE_ALL,		0, run_seq_read },
+	{ "pwrite",		BE_FILE,	0, run_pwrite },
+	{ "pread",		BE_FILE,	0, run_pread },
+	{ "sendfile",		BE_ALL,		0, run_sendfile },
+	{ "mmap-fault",		BE_FILE,	0, run_mmap_fault },
+	{ "poll-wakeup",	BE_STREAM,	0, run_poll_wakeup },
+	{ "epoll-wakeup",	BE_STREAM,	0, run_epoll_wakeup },
+	{ "open-close",		BE_ALL,		1, run_open_close },
+};
+
+/* === backend setup === */
+
+static const char *backend_name(int type)
+{
+	switch (type) {
+	case BE_PIPE:	return "pipe";
+	case BE_SOCKET:	return "socket";
+	case BE_FILE:	return "file";
+	}
+	return "unknown";
+}
+
+static void post_endpoint(struct endpoint *ep, int idx)
+{
+	snprintf(ep->wr_name, sizeof(ep->wr_name), "bench-%d-%d-w",
+		 getpid(), idx);
+	snprintf(ep->rd_name, sizeof(ep->rd_name), "bench-%d-%d-r",
+		 getpid(), idx);
+
+	if (srvfs_post(srv, ep->wr_name, ep->wr, SRVFS_REPLACE) ||
+	    srvfs_post(srv, ep->rd_name, ep->rd, SRVFS_REPLACE))
+		fail("posting backend");
+
+	ep->proxy_wr = srvfs_retrieve(srv, ep->wr_name,
+				      (ep->type == BE_PIPE) ? O_WRONLY : O_RDWR);
+	ep->proxy_rd = srvfs_retrieve(srv, ep->rd_name,
+				      (ep->type == BE_PIPE) ? O_RDONLY : O_RDWR);
+	if ((ep->proxy_wr == -1) || (ep->proxy_rd == -1))
+		fail("retrieving backend");
+}
+
+static int make_tmpfile(char *path, size_t len, int idx, const char* tag)
+{
+	int fd;
+
+	snprintf(path, len, "%s/srvfs-bench-%d-%d-%s", tmpdir, getpid(),
+		 idx, tag);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		fail("creating temp file");
+
+	return fd;
+}
+
+static void setup_endpoint(struct endpoint *ep, int type, int idx)
+{
+	char src_path[PATH_MAX];
+	int p1[2], p2[2], sv[2];
+
+	memset(ep, 0, sizeof(*ep));
+	ep->type = type;
+	ep->peer_rd = ep->peer_wr = -1;
+
+	switch (type) {
+	case BE_PIPE:
+		if (pipe(p1) || pipe(p2))
+			fail("creating pipes");
+		ep->wr = p1[1];
+		ep->peer_rd = p1[0];
+		ep->rd = p2[0];
+		ep->peer_wr = p2[1];
+		break;
+	case BE_SOCKET:
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+			fail("creating socketpair");
+		ep->wr = ep->rd = sv[0];
+		ep->peer_rd = ep->peer_wr = sv[1];
+		break;
+	case BE_FILE:
+		ep->wr = ep->rd = make_tmpfile(ep->path, sizeof(ep->path),
+					       idx, "file");
+		if (ftruncate(ep->wr, FILE_SIZE))
+			fail("sizing temp file");
+		break;
+	}
+
+	ep->src_fd = make_tmpfile(src_path, sizeof(src_path), idx, "src");
+	unlink(src_path);
+	if (ftruncate(ep->src_fd, SEQ_CHUNK))
+		fail("sizing sendfile source");
+
+	ep->null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (ep->null_fd == -1)
+		fail("opening /dev/null");
+
+	post_endpoint(ep, idx);
+}
+
+static void teardown_endpoint(struct endpoint *ep)
+{
+	close(ep->proxy_wr);
+	close(ep->proxy_rd);
+	srvfs_remove(srv, ep->wr_name);
+	srvfs_remove(srv, ep->rd_name);
+
+	close(ep->wr);
+	if (ep->rd != ep->wr)
+		close(ep->rd);
+	if (ep->peer_rd != -1)
+		close(ep->peer_rd);
+	if ((ep->peer_wr != -1) && (ep->peer_wr != ep->peer_rd))
+		close(ep->peer_wr);
+	close(ep->src_fd);
+	close(ep->null_fd);
+
+	if (ep->type == BE_FILE)
+		unlink(ep->path);
+}
+
+/* === runner === */
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	pthread_barrier_wait(w->barrier);
+	w->test->run(w);
+	pthread_barrier_wait(w->barrier);
+	return NULL;
+}
+
+static void run_test(const struct bench_test *test, struct endpoint *eps,
+		     int type, int proxied, int nthreads)
+{
+	struct worker workers[nthreads];
+	pthread_barrier_t barrier;
+	struct bench_result res = {
+		.test		= test->name,
+		.backend	= backend_name(type),
+		.mode		= proxied ? "srvfs" : "direct",
+		.threads	= nthreads,
+	};
+	uint64_t start;
+	int i;
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+	res.lat = calloc((size_t)nthreads * iterations, sizeof(uint64_t));
+	if (!res.lat)
+		fail("allocating latency buffer");
+
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+
+		memset(w, 0, sizeof(*w));
+		w->barrier = &barrier;
+		w->ep = &eps[i];
+		w->test = test;
+		w->proxied = proxied;
+		w->wr = proxied ? eps[i].proxy_wr : eps[i].wr;
+		w->rd = proxied ? eps[i].proxy_rd : eps[i].rd;
+		w->lat = res.lat + (size_t)i * iterations;
+		w->buf = calloc(1, SEQ_CHUNK > iosize ? SEQ_CHUNK : iosize);
+		if (!w->buf)
+			fail("allocating io buffer");
+
+		if (pthread_create(&w->thread, NULL, worker_main, w))
+			fail("creating worker");
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = bench_now_ns();
+	pthread_barrier_wait(&barrier);
+	res.ns = bench_now_ns() - start;
+
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+
+		/* compact the per thread latencies */
+		memmove(res.lat + res.nlat, w->lat, w->nlat * sizeof(uint64_t));
+		res.nlat += w->nlat;
+		res.ops += w->ops;
+		res.bytes += w->bytes;
+		free(w->buf);
+	}
+
+	bench_print(&res);
+
+	free(res.lat);
+	pthread_barrier_destroy(&barrier);
+}
+
+static void run_backend(int type)
+{
+	struct endpoint eps[max_threads];
+	size_t t;
+	int i, proxied, nthreads;
+
+	for (i = 0; i < max_threads; i++)
+		setup_endpoint(&eps[i], type, i);
+
+	for (t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		const struct bench_test *test = &tests[t];
+
+		if (!(test->backends & type))
+			continue;
+		if (only_test && strcmp(only_test, test->name))
+			continue;
+
+		for (proxied = 0; proxied < 2; proxied++) {
+			if (!proxied && test->direct_file_only &&
+			    (type != BE_FILE))
+				continue;
+
+			for (nthreads = 1; nthreads <= max_threads; nthreads++)
+				run_test(test, eps, type, proxied, nthreads);
+		}
+	}
+
+	for (i = 0; i < max_threads; i++)
+		teardown_endpoint(&eps[i]);
+}
+
+static unsigned int parse_backends(char *list)
+{
+	unsigned int mask = 0;
+	char *tok;
+
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+		if (!strcmp(tok, "pipe"))
+			mask |= BE_PIPE;
+		else if (!strcmp(tok, "socket"))
+			mask |= BE_SOCKET;
+		else if (!strcmp(tok, "file"))
+			mask |= BE_FILE;
+		else
+			fail("unknown backend");
+	}
+	return mask;
+}
+
+static void usage(void)
+{
+	fail("parameters: [-t max_threads] [-i iterations] [-s iosize] "
+	     "[-b pipe,socket,file] [-T test] [-d tmpdir] <srvfs>");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:i:s:b:T:d:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			iosize = atoi(optarg);
+			break;
+		case 'b':
+			backends = parse_backends(optarg);
+			break;
+		case 'T':
+			only_test = optarg;
+			break;
+		case 'd':
+			tmpdir = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind >= argc) || (max_threads < 1) || (iterations < 1) ||
+	    !iosize || (iosize > SEQ_CHUNK))
+		usage();
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	srv = srvfs_open(argv[optind]);
+	if (!srv)
+		fail("opening srvfs");
+
+	if (backends & BE_PIPE)
+		run_backend(BE_PIPE);
+	if (backends & BE_SOCKET)
+		run_backend(BE_SOCKET);
+	if (backends & BE_FILE)
+		run_backend(BE_FILE);
+
+	srvfs_close(srv);
+	return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * bench-sendfile: sendfile() throughput into posted sockets
+ *
+ * Sends a regular file over a loopback TCP connection, either via the
+ * socket itself or via an srvfs proxy of it, while a receiver thread
+ * drains the other end. For comparison, the "copy" test pushes the same
+ * data through read() and write().
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "libsrvfs.h"
+#include "common.h"
+#include "bench.h"
+
+#define RECV_BUFSIZE	(256 * 1024)
+
+static size_t filesize = 64 * 1024 * 1024;
+static size_t chunk = 1024 * 1024;
+static int iterations = 16;
+
+static struct srvfs *srv;
+static char entry_name[64];
+static char localname[256];
+
+struct receiver {
+	pthread_t thread;
+	int fd;
+	uint64_t total;
+};
+
+static void *receiver_main(void *arg)
+{
+	struct receiver *r = arg;
+	char *buf = malloc(RECV_BUFSIZE);
+	ssize_t ret;
+
+	if (!buf)
+		fail("allocating receive buffer");
+
+	while (r->total < (uint64_t)filesize * iterations) {
+		ret = read(r->fd, buf, RECV_BUFSIZE);
+		if (ret <= 0)
+			fail("receiving");
+		r->total += ret;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* connected loopback TCP pair, sv[0] is the sending side */
+static void tcp_pair(int sv[2])
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t len = sizeof(addr);
+	int lfd, one = 1;
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((lfd == -1) ||
+	    bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(lfd, 1) ||
+	    getsockname(lfd, (struct sockaddr *)&addr, &len))
+		fail("setting up listening socket");
+
+	sv[1] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((sv[1] == -1) ||
+	    connect(sv[1], (struct sockaddr *)&addr, sizeof(addr)))
+		fail("connecting");
+
+	sv[0] = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (sv[0] == -1)
+		fail("accepting");
+
+	setsockopt(sv[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	close(lfd);
+}
+
+static void send_sendfile(int out, int in)
+{
+	off_t off = 0;
+	ssize_t ret;
+
+	while ((size_t)off < filesize) {
+		ret = sendfile(out, in, &off, chunk);
+		if (ret <= 0)
+			fail("sendfile");
+	}
+}
+
+static void send_copy(int out, int in, char *buf)
+{
+	off_t off = 0;
+	ssize_t ret, done;
+
+	while ((size_t)off < filesize) {
+		ret = pread(in, buf, chunk, off);
+		if (ret <= 0)
+			fail("reading file");
+		off += ret;
+
+		for (done = 0; done < ret; ) {
+			ssize_t n = write(out, buf + done, ret - done);
+			if (n <= 0)
+				fail("writing to socket");
+			done += n;
+		}
+	}
+}
+
+/*
+ * mode "direct": send into the socket itself
+ * mode "srvfs": send into a proxy of the posted socket
+ */
+static void run(const char* test, const char* mode, int filefd)
+{
+	struct receiver receiver = { .total = 0 };
+	struct bench_result res = {
+		.test		= test,
+		.backend	= "tcp",
+		.mode		= mode,
+		.threads	= 1,
+	};
+	char extra[64];
+	char *buf = NULL;
+	uint64_t start;
+	int sv[2], out, i;
+
+	tcp_pair(sv);
+
+	if (strcmp(mode, "direct")) {
+		if (srvfs_post(srv, entry_name, sv[0], SRVFS_REPLACE))
+			fail("posting socket");
+		out = srvfs_retrieve(srv, entry_name, O_RDWR);
+		if (out == -1)
+			fail("retrieving socket");
+	} else {
+		out = sv[0];
+	}
+
+	if (!strcmp(test, "copy") && !(buf = malloc(chunk)))
+		fail("allocating copy buffer");
+
+	receiver.fd = sv[1];
+	if (pthread_create(&receiver.thread, NULL, receiver_main, &receiver))
+		fail("creating receiver");
+
+	start = bench_now_ns();
+	for (i = 0; i < iterations; i++) {
+		if (buf)
+			send_copy(out, filefd, buf);
+		else
+			send_sendfile(out, filefd);
+	}
+	pthread_join(receiver.thread, NULL);
+	res.ns = bench_now_ns() - start;
+
+	res.ops = iterations;
+	res.bytes = receiver.total;
+	snprintf(extra, sizeof(extra), "filesize=%zu chunk=%zu",
+		 filesize, chunk);
+	res.extra = extra;
+	bench_print(&res);
+
+	free(buf);
+	if (out != sv[0]) {
+		close(out);
+		srvfs_remove(srv, entry_name);
+	}
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/* fill the file and get it into the page cache */
+static int make_file(void)
+{
+	char *buf = malloc(chunk);
+	size_t off;
+	int fd;
+
+	if (!buf)
+		fail("allocating file buffer");
+	memset(buf, 'x', chunk);
+
+	fd = open_localfile(localname);
+	for (off = 0; off < filesize; off += chunk)
+		if (pwrite(fd, buf, chunk, off) != (ssize_t)chunk)
+			fail("writing file");
+
+	free(buf);
+	return fd;
+}
+
+static void usage(void)
+{
+	fail("parameters: [-s filesize] [-c chunk] [-i iterations] "
+	     "[-d tmpdir] <srvfs>");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *tmpdir = "/tmp";
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "s:c:i:d:")) != -1) {
+		switch (opt) {
+		case 's':
+			filesize = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'd':
+			tmpdir = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind >= argc) || !chunk || (filesize < chunk) ||
+	    (iterations < 1))
+		usage();
+
+	/* whole chunks only, so every pass sends exactly filesize */
+	filesize -= filesize % chunk;
+
+	srv = srvfs_open(argv[optind]);
+	if (!srv)
+		fail("opening srvfs");
+
+	snprintf(entry_name, sizeof(entry_name), "sendfile-%d", getpid());
+	snprintf(localname, sizeof(localname), "%s/srvfs-bench-sendfile-%d",
+		 tmpdir, getpid());
+	fd = make_file();
+
+	run("sendfile", "direct", fd);
+	run("sendfile", "srvfs", fd);
+	run("copy", "direct", fd);
+	run("copy", "srvfs", fd);
+
+	close(fd);
+	unlink(localname);
+	srvfs_close(srv);
+	return 0;
+}
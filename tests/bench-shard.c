@@ -0,0 +1,268 @@
+/*
+ * bench-shard: multi-producer write throughput into one posted entry
+ *
+ * Producers write fixed size messages into a single name, either directly
+ * into one pipe, via an srvfs entry backed by one pipe, or via a sharded
+ * srvfs entry backed by one pipe per shard. One consumer per pipe drains
+ * it and checks that messages arrive in one piece.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "libsrvfs.h"
+#include "common.h"
+#include "bench.h"
+
+#define MSGS_PER_READ	64
+
+static int max_producers = 4;
+static int nshards;
+static int messages = 100000;
+static size_t msgsize = 128;
+static int shard_node;
+
+static struct srvfs *srv;
+static char entry_name[64];
+
+static volatile int done;
+static volatile unsigned long consumed;
+static volatile unsigned long broken;
+
+struct consumer {
+	pthread_t thread;
+	int fd;
+};
+
+struct producer {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	int id;
+	int fd;
+};
+
+static void *consumer_main(void *arg)
+{
+	struct consumer *c = arg;
+	struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+	char *buf = malloc(msgsize * MSGS_PER_READ);
+	ssize_t ret;
+	size_t i;
+
+	if (!buf)
+		fail("allocating consumer buffer");
+
+	while (!done) {
+		if (poll(&pfd, 1, 100) != 1)
+			continue;
+
+		ret = read(c->fd, buf, msgsize * MSGS_PER_READ);
+		if (ret <= 0)
+			continue;
+
+		/* writes are atomic, so we always get whole messages */
+		if (ret % msgsize)
+			__sync_fetch_and_add(&broken, 1);
+
+		for (i = 0; i + msgsize <= (size_t)ret; i += msgsize)
+			if (buf[i] != buf[i + msgsize - 1])
+				__sync_fetch_and_add(&broken, 1);
+
+		__sync_fetch_and_add(&consumed, ret / msgsize);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void *producer_main(void *arg)
+{
+	struct producer *p = arg;
+	char *msg = malloc(msgsize);
+	int i;
+
+	if (!msg)
+		fail("allocating message");
+	memset(msg, 'a' + (p->id % 26), msgsize);
+
+	pthread_barrier_wait(p->barrier);
+	for (i = 0; i < messages; i++)
+		if (write(p->fd, msg, msgsize) != (ssize_t)msgsize)
+			fail("writing message");
+
+	free(msg);
+	return NULL;
+}
+
+static void make_pipes(int npipes, int *rd, int *wr)
+{
+	int i, pfd[2];
+
+	for (i = 0; i < npipes; i++) {
+		if (pipe2(pfd, O_CLOEXEC))
+			fail("creating pipe");
+		rd[i] = pfd[0];
+		wr[i] = pfd[1];
+	}
+}
+
+/*
+ * mode "direct": all producers share one pipe
+ * mode "single": entry backed by one pipe
+ * mode "sharded": entry backed by nshards pipes
+ */
+static void run(const char* mode, int nproducers)
+{
+	int npipes = strcmp(mode, "sharded") ? 1 : nshards;
+	int rd[npipes], wr[npipes];
+	struct consumer consumers[npipes];
+	struct producer producers[nproducers];
+	pthread_barrier_t barrier;
+	struct bench_result res = {
+		.test		= "shard-write",
+		.backend	= "pipe",
+		.mode		= mode,
+		.threads	= nproducers,
+	};
+	unsigned long total = (unsigned long)nproducers * messages;
+	char extra[128];
+	uint64_t start;
+	int i;
+
+	make_pipes(npipes, rd, wr);
+
+	if (!strcmp(mode, "single")) {
+		if (srvfs_post(srv, entry_name, wr[0], SRVFS_REPLACE))
+			fail("posting entry");
+	} else if (!strcmp(mode, "sharded")) {
+		if (srvfs_post_sharded(srv, entry_name, wr, npipes,
+				       SRVFS_REPLACE |
+				       (shard_node ? SRVFS_SHARD_NODE : 0)))
+			fail("posting sharded entry");
+	}
+
+	done = 0;
+	consumed = 0;
+	broken = 0;
+
+	for (i = 0; i < npipes; i++) {
+		consumers[i].fd = rd[i];
+		if (pthread_create(&consumers[i].thread, NULL, consumer_main,
+				   &consumers[i]))
+			fail("creating consumer");
+	}
+
+	pthread_barrier_init(&barrier, NULL, nproducers + 1);
+	for (i = 0; i < nproducers; i++) {
+		struct producer *p = &producers[i];
+
+		p->barrier = &barrier;
+		p->id = i;
+		if (strcmp(mode, "direct"))
+			p->fd = srvfs_retrieve(srv, entry_name, O_WRONLY);
+		else
+			p->fd = wr[0];
+		if (p->fd == -1)
+			fail("retrieving entry");
+
+		if (pthread_create(&p->thread, NULL, producer_main, p))
+			fail("creating producer");
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = bench_now_ns();
+
+	for (i = 0; i < nproducers; i++)
+		pthread_join(producers[i].thread, NULL);
+
+	while (consumed < total)
+		usleep(100);
+	res.ns = bench_now_ns() - start;
+
+	done = 1;
+	for (i = 0; i < npipes; i++)
+		pthread_join(consumers[i].thread, NULL);
+
+	res.ops = total;
+	res.bytes = total * msgsize;
+	snprintf(extra, sizeof(extra), "shards=%d msgsize=%zu broken=%lu",
+		 npipes, msgsize, broken);
+	res.extra = extra;
+	bench_print(&res);
+
+	for (i = 0; i < nproducers; i++)
+		if (producers[i].fd != wr[0])
+			close(producers[i].fd);
+	if (strcmp(mode, "direct"))
+		srvfs_remove(srv, entry_name);
+	for (i = 0; i < npipes; i++) {
+		close(rd[i]);
+		close(wr[i]);
+	}
+	pthread_barrier_destroy(&barrier);
+}
+
+static void usage(void)
+{
+	fail("parameters: [-t max_producers] [-s shards] [-m messages] "
+	     "[-l msgsize] [-N] <srvfs>");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "t:s:m:l:N")) != -1) {
+		switch (opt) {
+		case 't':
+			max_producers = atoi(optarg);
+			break;
+		case 's':
+			nshards = atoi(optarg);
+			break;
+		case 'm':
+			messages = atoi(optarg);
+			break;
+		case 'l':
+			msgsize = atoi(optarg);
+			break;
+		case 'N':
+			shard_node = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!nshards)
+		nshards = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* only writes up to PIPE_BUF are atomic */
+	if ((optind >= argc) || (max_producers < 1) || (nshards < 1) ||
+	    (messages < 1) || !msgsize || (msgsize > PIPE_BUF))
+		usage();
+
+	srv = srvfs_open(argv[optind]);
+	if (!srv)
+		fail("opening srvfs");
+
+	snprintf(entry_name, sizeof(entry_name), "shard-%d", getpid());
+
+	for (n = 1; n <= max_producers; n++) {
+		run("direct", n);
+		run("single", n);
+		run("sharded", n);
+	}
+
+	srvfs_close(srv);
+	return 0;
+}
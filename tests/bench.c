@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench.h"
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, unsigned long n, double p)
+{
+	unsigned long idx = (unsigned long)(p * (n - 1) / 100.0);
+
+	return sorted[idx];
+}
+
+void bench_print(struct bench_result *res)
+{
+	printf("test=%s", res->test);
+
+	if (res->backend)
+		printf(" backend=%s", res->backend);
+	if (res->mode)
+		printf(" mode=%s", res->mode);
+	if (res->threads)
+		printf(" threads=%d", res->threads);
+	if (res->extra)
+		printf(" %s", res->extra);
+
+	printf(" ops=%lu ns_per_op=%.1f ops_per_sec=%.0f", res->ops,
+	       res->ops ? (double)res->ns / res->ops : 0,
+	       res->ns ? (double)res->ops * 1000000000.0 / res->ns : 0);
+
+	if (res->bytes)
+		printf(" bytes=%llu bytes_per_sec=%.0f",
+		       (unsigned long long)res->bytes,
+		       res->ns ? (double)res->bytes * 1000000000.0 / res->ns : 0);
+
+	if (res->lat && res->nlat) {
+		qsort(res->lat, res->nlat, sizeof(uint64_t), cmp_u64);
+		printf(" p50=%llu p90=%llu p99=%llu p999=%llu max=%llu",
+		       (unsigned long long)percentile(res->lat, res->nlat, 50),
+		       (unsigned long long)percentile(res->lat, res->nlat, 90),
+		       (unsigned long long)percentile(res->lat, res->nlat, 99),
+		       (unsigned long long)percentile(res->lat, res->nlat, 99.9),
+		       (unsigned long long)res->lat[res->nlat - 1]);
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+void bench_report(const char* test, unsigned long ops, uint64_t ns)
+{
+	struct bench_result res = {
+		.test	= test,
+		.ops	= ops,
+		.ns	= ns,
+	};
+
+	bench_print(&res);
+}
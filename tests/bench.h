@@ -0,0 +1,28 @@
+#ifndef __SRVFS_TESTS_BENCH_H
+#define __SRVFS_TESTS_BENCH_H
+
+#include <stdint.h>
+
+/*
+ * One result line. Everything except test is optional (NULL / 0) and
+ * omitted from the output then. Results are printed as space separated
+ * key=value pairs, one line per result, so they're easy to parse.
+ */
+struct bench_result {
+	const char *test;
+	const char *backend;
+	const char *mode;
+	int threads;
+	const char *extra;	/* additional key=value pairs, printed as is */
+	unsigned long ops;
+	uint64_t ns;		/* wall clock time of the whole run */
+	uint64_t bytes;		/* payload transferred, for throughput */
+	uint64_t *lat;		/* per op latencies in ns, gets sorted */
+	unsigned long nlat;
+};
+
+uint64_t bench_now_ns(void);
+void bench_print(struct bench_result *res);
+void bench_report(const char* test, unsigned long ops, uint64_t ns);
+
+#endif /* __SRVFS_TESTS_BENCH_H */
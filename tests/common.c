@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <string.h>
 
+#include "libsrvfs.h"
 #include "common.h"
 
 void fail(const char* msg)
@@ -13,27 +14,9 @@ void fail(const char* msg)
 	exit(1);
 }
 
-int open_ctrlfile(const char* srvfs, const char* name)
-{
-	char srvfile[PATH_MAX];
-	int ctrl_fd;
-	snprintf(srvfile, sizeof(srvfile), "%s/%s", srvfs, name);
-	fprintf(stderr, "INFO: srv file name: %s\n", srvfile);
-
-	unlink(srvfile);
-	ctrl_fd = open(srvfile, O_CREAT | O_RDWR);
-
-	if (ctrl_fd == -1)
-		fail("opening control file");
-
-	fprintf(stderr, "INFO: opened control file at fd %d\n", ctrl_fd);
-
-	return ctrl_fd;
-}
-
 int open_localfile(const char* fn)
 {
-	int fd = open(fn, O_RDWR | O_CREAT);
+	int fd = open(fn, O_RDWR | O_CREAT, 0644);
 	if (fd == -1)
 		fail("creating local file\n");
 
@@ -44,12 +27,15 @@ int open_localfile(const char* fn)
 
 int assign_fd(const char* srvfs, const char* ctrlname, int local_fd)
 {
-	char buffer[1024];
-	int ctrl_fd = open_ctrlfile(srvfs, ctrlname);
+	struct srvfs *srv = srvfs_open(srvfs);
+
+	if (!srv)
+		fail("opening srvfs");
+
+	fprintf(stderr, "INFO assigning fd %d to %s/%s\n", local_fd, srvfs, ctrlname);
+	if (srvfs_post(srv, ctrlname, local_fd, SRVFS_REPLACE) == -1)
+		fail("posting fd");
 
-	fprintf(stderr, "INFO assigning fd %d to %s/%s (%d)\n", local_fd, srvfs, ctrlname, ctrl_fd);
-	snprintf(buffer, sizeof(buffer), "%ld", local_fd);
-	write(ctrl_fd, buffer, strlen(buffer));
-	close(ctrl_fd);
+	srvfs_close(srv);
 	return 0;
 }
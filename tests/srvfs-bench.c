@@ -0,0 +1,219 @@
+/*
+ * srvfs-bench: measure post, retrieve and I/O rates on a mounted srvfs
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libsrvfs.h"
+#include "common.h"
+#include "bench.h"
+
+#define NAME_FMT	"bench-%d"
+#define IO_NAME		"bench-io"
+
+static int entries = 1000;
+static int iterations = 100000;
+static size_t iosize = 64;
+
+static char **names;
+
+static void make_names(void)
+{
+	int i;
+
+	names = calloc(entries, sizeof(char *));
+	if (!names)
+		fail("allocating names");
+
+	for (i = 0; i < entries; i++)
+		if (asprintf(&names[i], NAME_FMT, i) == -1)
+			fail("allocating names");
+}
+
+static void bench_post(struct srvfs *srv, int fd)
+{
+	struct srvfs_post_entry *ents;
+	uint64_t start;
+	int i, posted;
+
+	ents = calloc(entries, sizeof(*ents));
+	if (!ents)
+		fail("allocating post entries");
+
+	for (i = 0; i < entries; i++) {
+		ents[i].name = names[i];
+		ents[i].fd = fd;
+	}
+
+	start = bench_now_ns();
+	posted = srvfs_post_batch(srv, ents, entries, SRVFS_REPLACE);
+	bench_report("post", posted, bench_now_ns() - start);
+
+	if (posted != entries) {
+		for (i = 0; i < entries; i++)
+			if (ents[i].error) {
+				errno = ents[i].error;
+				perror(ents[i].name);
+				break;
+			}
+		fail("posting entries");
+	}
+
+	free(ents);
+}
+
+static void bench_repost(struct srvfs *srv, int fd)
+{
+	uint64_t start = bench_now_ns();
+	int i;
+
+	for (i = 0; i < entries; i++)
+		if (srvfs_repost(srv, names[i], fd) == -1)
+			fail("reposting entry");
+
+	bench_report("repost", entries, bench_now_ns() - start);
+}
+
+static void bench_retrieve(struct srvfs *srv)
+{
+	uint64_t start = bench_now_ns();
+	int i, fd;
+
+	for (i = 0; i < entries; i++) {
+		fd = srvfs_retrieve(srv, names[i], O_WRONLY);
+		if (fd == -1)
+			fail("retrieving entry");
+		close(fd);
+	}
+
+	bench_report("retrieve", entries, bench_now_ns() - start);
+}
+
+static int count_entry(const char* name, void *arg)
+{
+	(*(int *)arg)++;
+	return 0;
+}
+
+static void bench_list(struct srvfs *srv)
+{
+	uint64_t start = bench_now_ns();
+	int count = 0;
+
+	if (srvfs_list(srv, count_entry, &count) == -1)
+		fail("listing entries");
+
+	bench_report("list", count, bench_now_ns() - start);
+}
+
+static void bench_remove(struct srvfs *srv)
+{
+	uint64_t start = bench_now_ns();
+	int i;
+
+	for (i = 0; i < entries; i++)
+		if (srvfs_remove(srv, names[i]) == -1)
+			fail("removing entry");
+
+	bench_report("remove", entries, bench_now_ns() - start);
+}
+
+static void run_io(const char* test, int wr_fd, int rd_fd)
+{
+	char *buf = calloc(1, iosize);
+	uint64_t start;
+	int i;
+
+	if (!buf)
+		fail("allocating io buffer");
+
+	start = bench_now_ns();
+	for (i = 0; i < iterations; i++) {
+		if (write(wr_fd, buf, iosize) != (ssize_t)iosize)
+			fail("writing");
+		if (read(rd_fd, buf, iosize) != (ssize_t)iosize)
+			fail("reading");
+	}
+	bench_report(test, iterations, bench_now_ns() - start);
+
+	free(buf);
+}
+
+static void bench_io(struct srvfs *srv)
+{
+	int pfd[2], proxy_fd;
+
+	if (pipe(pfd) == -1)
+		fail("creating pipe");
+
+	if (srvfs_post(srv, IO_NAME, pfd[1], SRVFS_REPLACE) == -1)
+		fail("posting io pipe");
+
+	proxy_fd = srvfs_retrieve(srv, IO_NAME, O_WRONLY);
+	if (proxy_fd == -1)
+		fail("retrieving io pipe");
+
+	run_io("io-direct", pfd[1], pfd[0]);
+	run_io("io-srvfs", proxy_fd, pfd[0]);
+
+	close(proxy_fd);
+	srvfs_remove(srv, IO_NAME);
+	close(pfd[0]);
+	close(pfd[1]);
+}
+
+static void usage(void)
+{
+	fail("parameters: [-n entries] [-i iterations] [-s iosize] <srvfs>");
+}
+
+int main(int argc, char *argv[])
+{
+	struct srvfs *srv;
+	int opt, pfd[2];
+
+	while ((opt = getopt(argc, argv, "n:i:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			entries = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			iosize = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind >= argc) || (entries < 1) || (iterations < 1) || !iosize)
+		usage();
+
+	srv = srvfs_open(argv[optind]);
+	if (!srv)
+		fail("opening srvfs");
+
+	if (pipe(pfd) == -1)
+		fail("creating pipe");
+
+	make_names();
+
+	bench_post(srv, pfd[1]);
+	bench_repost(srv, pfd[1]);
+	bench_retrieve(srv);
+	bench_list(srv);
+	bench_remove(srv);
+	bench_io(srv);
+
+	srvfs_close(srv);
+	return 0;
+}
@@ -0,0 +1,90 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "libsrvfs.h"
+#include "common.h"
+
+#define SRVFILENAME	"test-epoll-repost"
+#define TIMEOUT_MS	1000
+
+/*
+ * Edge triggered epoll on a proxy must follow the entry when it gets
+ * reposted to another socket.
+ */
+static void make_socketpair(int sv[2])
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv))
+		fail("creating socketpair");
+}
+
+static int wait_event(int epfd)
+{
+	struct epoll_event ev;
+	return epoll_wait(epfd, &ev, 1, TIMEOUT_MS);
+}
+
+int doit(const char* srvfs)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET };
+	struct srvfs *srv = srvfs_open(srvfs);
+	int a[2], b[2], proxy, epfd;
+	char c = 0;
+
+	if (!srv)
+		fail("opening srvfs");
+
+	make_socketpair(a);
+	make_socketpair(b);
+
+	if (srvfs_post(srv, SRVFILENAME, a[0], SRVFS_REPLACE))
+		fail("posting first socket");
+
+	proxy = srvfs_retrieve(srv, SRVFILENAME, O_RDWR);
+	if (proxy == -1)
+		fail("retrieving entry");
+
+	epfd = epoll_create1(0);
+	if ((epfd == -1) || epoll_ctl(epfd, EPOLL_CTL_ADD, proxy, &ev))
+		fail("setting up epoll");
+
+	if ((write(a[1], &c, 1) != 1) || (wait_event(epfd) != 1))
+		fail("no event from first socket");
+	if (read(proxy, &c, 1) != 1)
+		fail("reading from first socket");
+
+	if (srvfs_repost(srv, SRVFILENAME, b[0]))
+		fail("reposting second socket");
+
+	/* the repost itself kicks the waiters */
+	wait_event(epfd);
+
+	if ((write(b[1], &c, 1) != 1) || (wait_event(epfd) != 1))
+		fail("no event from second socket after repost");
+	if (read(proxy, &c, 1) != 1)
+		fail("reading from second socket");
+
+	/* the old socket must not wake us anymore */
+	if ((write(a[1], &c, 1) != 1) || (wait_event(epfd) != 0))
+		fail("event from old socket after repost");
+
+	close(epfd);
+	close(proxy);
+	srvfs_remove(srv, SRVFILENAME);
+	srvfs_close(srv);
+
+	fprintf(stderr, "INFO: epoll repost test passed\n");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc<2)
+		fail("parameters: <srvfs>");
+
+	return doit(argv[1]);
+}
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+
+#include "libsrvfs.h"
+#include "common.h"
+
+#define SRVFILENAME	"test-locks"
+
+static int nprocs = 8;
+static int increments = 1000;
+
+static struct srvfs *srv;
+static char localname[256];
+
+/*
+ * Locks taken through a proxy must live on the backend's inode, so they
+ * conflict with the backend itself as well as with other proxies, and
+ * have to be gone once the proxy is closed.
+ */
+static int retrieve(int oflags)
+{
+	int fd = srvfs_retrieve(srv, SRVFILENAME, oflags);
+
+	if (fd == -1)
+		fail("retrieving entry");
+	return fd;
+}
+
+static int setlk(int fd, int cmd, short type)
+{
+	struct flock fl = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+	};
+
+	return fcntl(fd, cmd, &fl);
+}
+
+/* run fn in a child process, which has separate POSIX lock ownership */
+static int in_child(int (*fn)(int), int fd)
+{
+	int status;
+	pid_t pid = fork();
+
+	if (pid == -1)
+		fail("forking");
+	if (!pid)
+		_exit(fn(fd));
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		fail("waiting for child");
+	return WEXITSTATUS(status);
+}
+
+static int try_posix_lock(int fd)
+{
+	return setlk(fd, F_SETLK, F_WRLCK) ? errno : 0;
+}
+
+static void test_posix(int backend)
+{
+	int proxy = retrieve(O_RDWR);
+
+	if (setlk(proxy, F_SETLK, F_WRLCK))
+		fail("taking POSIX lock via proxy");
+
+	/* others see our lock on the backend as well as via the entry */
+	if (in_child(try_posix_lock, backend) != EAGAIN)
+		fail("POSIX lock via proxy doesn't conflict with backend");
+	if (in_child(try_posix_lock, proxy) != EAGAIN)
+		fail("POSIX lock via proxy doesn't conflict with proxy");
+
+	/* closing any fd on the file drops the process' POSIX locks */
+	close(proxy);
+	if (in_child(try_posix_lock, backend))
+		fail("POSIX lock still held after closing the proxy");
+}
+
+static void test_ofd(void)
+{
+	int a = retrieve(O_RDWR), b = retrieve(O_RDWR);
+
+	if (setlk(a, F_OFD_SETLK, F_WRLCK))
+		fail("taking OFD lock via proxy");
+
+	/* each open of the entry is a separate owner */
+	if (!setlk(b, F_OFD_SETLK, F_WRLCK) || (errno != EAGAIN))
+		fail("OFD locks on two proxies don't conflict");
+
+	close(a);
+	if (setlk(b, F_OFD_SETLK, F_WRLCK))
+		fail("OFD lock still held after closing the proxy");
+	close(b);
+}
+
+static void test_flock(int backend)
+{
+	int a = retrieve(O_RDWR), b = retrieve(O_RDWR);
+
+	if (flock(a, LOCK_EX | LOCK_NB))
+		fail("taking flock via proxy");
+
+	if (!flock(b, LOCK_EX | LOCK_NB) || (errno != EWOULDBLOCK))
+		fail("flock on two proxies doesn't conflict");
+	if (!flock(backend, LOCK_EX | LOCK_NB) || (errno != EWOULDBLOCK))
+		fail("flock via proxy doesn't conflict with backend");
+
+	close(a);
+	if (flock(b, LOCK_EX | LOCK_NB))
+		fail("flock still held after closing the proxy");
+	close(b);
+}
+
+static volatile sig_atomic_t lease_broken;
+
+static void on_sigio(int sig)
+{
+	(void)(sig);
+	lease_broken = 1;
+}
+
+static void test_lease(void)
+{
+	int proxy = retrieve(O_RDONLY);
+	int fd, i;
+
+	/* the holder gets a SIGIO on the proxy when it's to be broken */
+	signal(SIGIO, on_sigio);
+
+	/* the entry itself holds the backend open, so no write leases */
+	if (!fcntl(proxy, F_SETLEASE, F_WRLCK))
+		fail("got write lease via proxy");
+
+	if (fcntl(proxy, F_SETLEASE, F_RDLCK))
+		fail("taking read lease via proxy");
+
+	/* writers have to break it first, through the entry as well */
+	fd = srvfs_retrieve(srv, SRVFILENAME, O_WRONLY | O_NONBLOCK);
+	if ((fd != -1) || (errno != EWOULDBLOCK))
+		fail("read lease via proxy not broken by writing proxy");
+
+	fd = open(localname, O_WRONLY | O_NONBLOCK);
+	if ((fd != -1) || (errno != EWOULDBLOCK))
+		fail("read lease via proxy not broken by writer");
+
+	for (i = 0; !lease_broken && (i < 100); i++)
+		usleep(10000);
+	if (!lease_broken)
+		fail("no SIGIO for the lease break on the proxy");
+
+	close(proxy);
+	fd = open(localname, O_WRONLY | O_NONBLOCK);
+	if (fd == -1)
+		fail("read lease still held after closing the proxy");
+	close(fd);
+}
+
+/* lots of processes incrementing a counter in the file, under lock */
+static int increment(int unused)
+{
+	int proxy = retrieve(O_RDWR);
+	unsigned long counter;
+	int i;
+
+	(void)(unused);
+
+	for (i = 0; i < increments; i++) {
+		if (setlk(proxy, F_SETLKW, F_WRLCK))
+			fail("waiting for lock");
+
+		if (pread(proxy, &counter, sizeof(counter), 0) !=
+		    sizeof(counter))
+			fail("reading counter");
+		counter++;
+		if (pwrite(proxy, &counter, sizeof(counter), 0) !=
+		    sizeof(counter))
+			fail("writing counter");
+
+		if (setlk(proxy, F_SETLK, F_UNLCK))
+			fail("unlocking");
+	}
+
+	close(proxy);
+	return 0;
+}
+
+static void test_contention(int backend)
+{
+	unsigned long counter = 0;
+	pid_t pids[nprocs];
+	int i, status;
+
+	if (pwrite(backend, &counter, sizeof(counter), 0) != sizeof(counter))
+		fail("resetting counter");
+
+	for (i = 0; i < nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] == -1)
+			fail("forking");
+		if (!pids[i])
+			_exit(increment(0));
+	}
+
+	for (i = 0; i < nprocs; i++)
+		if ((waitpid(pids[i], &status, 0) != pids[i]) ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			fail("incrementing process failed");
+
+	if (pread(backend, &counter, sizeof(counter), 0) != sizeof(counter))
+		fail("reading counter");
+	if (counter != (unsigned long)nprocs * increments)
+		fail("lost updates under POSIX lock via proxies");
+}
+
+int doit(const char* srvfs, const char* tmpdir)
+{
+	int backend;
+
+	srv = srvfs_open(srvfs);
+	if (!srv)
+		fail("opening srvfs");
+
+	snprintf(localname, sizeof(localname), "%s/srvfs-test-locks-%d",
+		 tmpdir, getpid());
+	backend = open_localfile(localname);
+
+	if (srvfs_post(srv, SRVFILENAME, backend, SRVFS_REPLACE))
+		fail("posting file");
+
+	test_posix(backend);
+	test_ofd();
+	test_flock(backend);
+	test_contention(backend);
+
+	/* read leases need the backend open read-only only */
+	close(backend);
+	backend = open(localname, O_RDONLY);
+	if ((backend == -1) ||
+	    srvfs_post(srv, SRVFILENAME, backend, SRVFS_REPLACE))
+		fail("posting file read-only");
+	close(backend);
+	test_lease();
+
+	srvfs_remove(srv, SRVFILENAME);
+	unlink(localname);
+	srvfs_close(srv);
+
+	fprintf(stderr, "INFO: lock test passed\n");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *tmpdir = "/tmp";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:i:d:")) != -1) {
+		switch (opt) {
+		case 'p':
+			nprocs = atoi(optarg);
+			break;
+		case 'i':
+			increments = atoi(optarg);
+			break;
+		case 'd':
+			tmpdir = optarg;
+			break;
+		default:
+			fail("parameters: [-p procs] [-i increments] "
+			     "[-d tmpdir] <srvfs>");
+		}
+	}
+
+	if ((optind >= argc) || (nprocs < 1) || (increments < 1))
+		fail("parameters: [-p procs] [-i increments] [-d tmpdir] "
+		     "<srvfs>");
+
+	return doit(argv[optind], tmpdir);
+}